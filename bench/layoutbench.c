@@ -0,0 +1,116 @@
+/* layoutbench - throughput of the tiling math, no X server involved
+ *
+ * Runs layout_tile() from src/layout.h over a few monitor shapes and client
+ * counts, checks the geometry against what the layout promises (fill, master
+ * split, padding, spacing of a crowded stack) and prints the time per layout
+ * pass as JSON lines on stdout. Exits non-zero on the first broken promise.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/layout.h"
+
+#define LENGTH(X) (sizeof(X) / sizeof(X[0]))
+#define PADDING 10
+#define MIN_H 100
+#define MASTER_SIZE 0.6
+#define WORK 2000000L /* windows laid out per case */
+
+static void die(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void fail(const char *name, int n, const char *what, int i, const Rect *r) {
+    die("layoutbench: %s n=%d: %s (window %d at %d,%d %dx%d)", name, n, what, i, r->x, r->y, r->w, r->h);
+}
+
+static int inside(const Rect *r, Rect a) {
+    return r->w >= 1 && r->h >= 1 && r->x >= a.x && r->y >= a.y &&
+           r->x + r->w <= a.x + a.w && r->y + r->h <= a.y + a.h;
+}
+
+/* what layout_tile promises, derived independently of its code */
+static void check(const char *name, Rect mon, const int st[4], int n, const Rect *geom) {
+    Rect u = {mon.x + st[0] + PADDING, mon.y + st[2] + PADDING,
+              mon.w - st[0] - st[1] - 2 * PADDING, mon.h - st[2] - st[3] - 2 * PADDING};
+    if (u.w < 1) u.x = mon.x, u.w = mon.w; /* struts that leave no room are ignored */
+    if (u.h < 1) u.y = mon.y, u.h = mon.h;
+
+    for (int i = 0; i < n; i++)
+        if (!inside(&geom[i], u)) fail(name, n, "leaves the usable area", i, &geom[i]);
+    if (n == 1) {
+        if (geom[0].x != u.x || geom[0].y != u.y || geom[0].w != u.w || geom[0].h != u.h)
+            fail(name, n, "single window does not fill the usable area", 0, &geom[0]);
+        return;
+    }
+
+    int mw = (int)(u.w * MASTER_SIZE);
+    if (mw >= 1 && u.w - mw - PADDING >= 1 &&
+        (geom[0].w != mw || geom[0].x + geom[0].w != u.x + u.w || geom[0].y != u.y || geom[0].h != u.h))
+        fail(name, n, "master is not master_size of the usable width", 0, &geom[0]);
+
+    int k = n - 1, min_h = MIN_H < u.h ? MIN_H : u.h;
+    if ((u.h - (k - 1) * PADDING) / k >= min_h) {
+        for (int i = 2; i < n; i++)
+            if (geom[i - 1].y + geom[i - 1].h + PADDING > geom[i].y)
+                fail(name, n, "stack windows overlap although they fit", i, &geom[i]);
+        if (geom[n - 1].y + geom[n - 1].h != u.y + u.h)
+            fail(name, n, "stack does not reach the bottom", n - 1, &geom[n - 1]);
+    } else {
+        for (int i = 1; i < n; i++)
+            if (geom[i].h != min_h) fail(name, n, "crowded stack window is not min_h tall", i, &geom[i]);
+        for (int i = 3; i < n; i++) {
+            int step = geom[i].y - geom[i - 1].y, first = geom[2].y - geom[1].y;
+            if (step < first - 1 || step > first + 1) fail(name, n, "crowded stack is not evenly spaced", i, &geom[i]);
+        }
+        if (geom[1].y != u.y || geom[n - 1].y + geom[n - 1].h != u.y + u.h)
+            fail(name, n, "crowded stack does not span the usable height", n - 1, &geom[n - 1]);
+    }
+}
+
+int main(void) {
+    static Rect geom[500];
+    struct {
+        const char *name;
+        Rect mon;
+        int struts[4];
+    } cases[] = {
+        {"1080p", {0, 0, 1920, 1080}, {0, 0, 0, 0}},
+        {"1080p_bar", {1920, 0, 1920, 1080}, {0, 0, 30, 0}},
+        {"huge_struts", {0, 0, 1920, 1080}, {0, 0, 1000, 1000}},
+        {"no_room", {0, 0, 1920, 1080}, {1000, 1000, 1000, 1000}},
+        {"tiny", {0, 0, 120, 90}, {0, 0, 0, 0}},
+    };
+    int counts[] = {1, 2, 10, 100, 500};
+
+    for (size_t c = 0; c < LENGTH(cases); c++) {
+        for (size_t k = 0; k < LENGTH(counts); k++) {
+            int n = counts[k];
+            long iters = WORK / n;
+            layout_tile(cases[c].mon, cases[c].struts, PADDING, MASTER_SIZE, MIN_H, n, geom);
+            check(cases[c].name, cases[c].mon, cases[c].struts, n, geom);
+
+            long t = now_ns();
+            for (long i = 0; i < iters; i++)
+                layout_tile(cases[c].mon, cases[c].struts, PADDING, MASTER_SIZE, MIN_H, n, geom);
+            t = now_ns() - t;
+            printf("{\"op\":\"layout\",\"case\":\"%s\",\"clients\":%d,\"iterations\":%ld,"
+                   "\"ns_per_layout\":%.1f,\"ns_per_window\":%.2f}\n", cases[c].name, n, iters,
+                   (double)t / iters, (double)t / iters / n);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+# run xbench against eowm on a private Xvfb, results go to stdout as JSON lines
+# assumes the default Alt bindings from def.config.h
+set -e
+cd "$(dirname "$0")/.."
+DPY=${BENCH_DISPLAY:-99}
+PROXY=${BENCH_PROXY_DISPLAY:-98}
+
+Xvfb :"$DPY" -screen 0 1920x1080x24 -nolisten tcp >/dev/null 2>&1 &
+XVFB=$!
+trap 'kill $XVFB 2>/dev/null' EXIT INT TERM
+# give up after 10s, or at once if Xvfb is missing or exited
+n=0
+while [ ! -S /tmp/.X11-unix/X"$DPY" ]; do
+    if ! kill -0 $XVFB 2>/dev/null || [ $n -ge 200 ]; then
+        echo "bench: Xvfb :$DPY did not start" >&2
+        exit 1
+    fi
+    n=$((n + 1))
+    sleep 0.05
+done
+
+bench/xbench -d "$DPY" -p "$PROXY" -e ./eowm "$@"
@@ -0,0 +1,111 @@
+/* spawnbench - launch-to-exit latency of fork+sh -c versus posix_spawn
+ *
+ * The parent holds a ballast of touched memory so fork() has page tables
+ * to copy, like a long-running WM does. Each launch runs /bin/true and is
+ * timed until waitpid() returns. Results are JSON lines on stdout.
+ */
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LENGTH(X) (sizeof(X) / sizeof(X[0]))
+#define MAXSAMPLES 1000
+
+extern char **environ;
+
+static void die(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* what spawn() did before: fork the whole process, then go through a shell */
+static pid_t fork_sh(void) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        execl("/bin/sh", "sh", "-c", "true", (char *)NULL);
+        _exit(1);
+    }
+    return pid;
+}
+
+static pid_t spawn_argv(char *const argv[]) {
+    pid_t pid;
+    return posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) ? -1 : pid;
+}
+
+static pid_t spawn_direct(void) {
+    char *argv[] = {"true", NULL};
+    return spawn_argv(argv);
+}
+
+static pid_t spawn_sh(void) {
+    char *argv[] = {"/bin/sh", "-c", "true", NULL};
+    return spawn_argv(argv);
+}
+
+static int cmplong(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    static long us[MAXSAMPLES];
+    int samples = 200, ballast_mb = 64, opt;
+    struct {
+        const char *op;
+        pid_t (*launch)(void);
+    } modes[] = {
+        {"fork_sh", fork_sh},
+        {"posix_spawn_sh", spawn_sh},
+        {"posix_spawn", spawn_direct},
+    };
+
+    while ((opt = getopt(argc, argv, "s:m:")) != -1) {
+        switch (opt) {
+        case 's': samples = atoi(optarg); break;
+        case 'm': ballast_mb = atoi(optarg); break;
+        default: die("usage: spawnbench [-s samples] [-m ballast MiB]");
+        }
+    }
+    if (samples < 1 || samples > MAXSAMPLES) die("samples must be 1..%d", MAXSAMPLES);
+
+    size_t size = (size_t)ballast_mb << 20;
+    char *ballast = size ? malloc(size) : NULL;
+    if (size && !ballast) die("out of memory");
+    if (ballast) memset(ballast, 1, size);
+
+    for (size_t m = 0; m < LENGTH(modes); m++) {
+        long sum = 0;
+        for (int i = 0; i < samples; i++) {
+            long t = now_us();
+            pid_t pid = modes[m].launch();
+            if (pid < 0) die("spawnbench: %s failed", modes[m].op);
+            waitpid(pid, NULL, 0);
+            us[i] = now_us() - t;
+            sum += us[i];
+        }
+        qsort(us, samples, sizeof(long), cmplong);
+        printf("{\"op\":\"%s\",\"ballast_mb\":%d,\"samples\":%d,\"mean_us\":%ld,\"p50_us\":%ld,"
+               "\"p95_us\":%ld,\"max_us\":%ld}\n", modes[m].op, ballast_mb, samples, sum / samples,
+               us[samples / 2], us[samples * 95 / 100], us[samples - 1]);
+    }
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,454 @@
+/* xbench - drive eowm on a headless X server and report latencies as JSON lines
+ *
+ * eowm is started on a proxy display that forwards to the real one and counts
+ * the requests it sends and the replies it waits for. The bench itself talks
+ * to the real display directly, so only eowm's traffic is counted.
+ */
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LENGTH(X) (sizeof(X) / sizeof(X[0]))
+#define MAXCONN 32
+#define MAXSAMPLES 64
+#define TIMEOUT_MS 5000
+#define IDLE_MS 30
+#define INIT_SIZE 1
+
+/* one direction of a proxied connection, split into X protocol messages */
+typedef struct {
+    unsigned char hdr[12];
+    int hlen, setup, order;
+    unsigned long skip;
+} Stream;
+
+typedef struct {
+    int cfd, sfd;
+    Stream up, down;
+} Conn;
+
+typedef struct {
+    int configured, maps, unmaps, focusin;
+} Tally;
+
+typedef struct {
+    const char *op;
+    int n, count;
+    long us[MAXSAMPLES];
+    unsigned long requests, replies;
+} Sample;
+
+static Display *dpy;
+static Window root;
+static Window *wins;
+static XRectangle *geom;
+static int *wstate, nwins, samples = 20;
+static Tally tally;
+static const char *eowm_path = "./eowm";
+static int real_display = 99, proxy_display = 98;
+static volatile unsigned long nrequests, nreplies;
+static volatile long last_activity;
+
+static void die(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static unsigned long get16(const unsigned char *p, int order) {
+    return order == 'B' ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+}
+
+static unsigned long get32(const unsigned char *p, int order) {
+    return order == 'B' ? ((unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3])
+                        : ((unsigned long)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+}
+
+/* client -> server: connection setup, then requests (BIG-REQUESTS aware) */
+static void scan_up(Stream *st, const unsigned char *p, size_t n) {
+    while (n) {
+        if (st->skip) {
+            size_t k = st->skip < n ? st->skip : n;
+            st->skip -= k; p += k; n -= k;
+            continue;
+        }
+        st->hdr[st->hlen++] = *p++;
+        n--;
+        if (st->setup) {
+            if (st->hlen < 12) continue;
+            st->order = st->hdr[0];
+            unsigned long an = get16(st->hdr + 6, st->order), ad = get16(st->hdr + 8, st->order);
+            st->skip = ((an + 3) & ~3UL) + ((ad + 3) & ~3UL);
+            st->setup = 0;
+        } else {
+            if (st->hlen < 4) continue;
+            unsigned long len = get16(st->hdr + 2, st->order);
+            if (!len && st->hlen < 8) continue;
+            if (!len) len = get32(st->hdr + 4, st->order);
+            st->skip = len * 4 - st->hlen;
+            __atomic_add_fetch(&nrequests, 1, __ATOMIC_RELAXED);
+        }
+        st->hlen = 0;
+    }
+}
+
+/* server -> client: setup reply, then 32-byte events/errors and sized replies */
+static void scan_down(Stream *st, int order, const unsigned char *p, size_t n) {
+    while (n) {
+        if (st->skip) {
+            size_t k = st->skip < n ? st->skip : n;
+            st->skip -= k; p += k; n -= k;
+            continue;
+        }
+        st->hdr[st->hlen++] = *p++;
+        n--;
+        if (st->hlen < 8) continue;
+        if (st->setup) {
+            st->skip = get16(st->hdr + 6, order) * 4;
+            st->setup = 0;
+        } else {
+            int type = st->hdr[0] & 0x7f;
+            st->skip = 32 - 8;
+            if (type == 1 || type == GenericEvent) st->skip += get32(st->hdr + 4, order) * 4;
+            if (type == 1) __atomic_add_fetch(&nreplies, 1, __ATOMIC_RELAXED);
+        }
+        st->hlen = 0;
+    }
+}
+
+static int xsocket(int display, int listening) {
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "/tmp/.X11-unix/X%d", display);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (listening) {
+        /* bind fails on an existing path, so a live display is never taken over */
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 8) < 0) goto fail;
+    } else if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        goto fail;
+    }
+    return fd;
+fail:
+    close(fd);
+    return -1;
+}
+
+static int writeall(int fd, const unsigned char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w; n -= w;
+    }
+    return 0;
+}
+
+static void *proxy(void *arg) {
+    int lfd = *(int *)arg, nconn = 0;
+    Conn conns[MAXCONN];
+    unsigned char buf[65536];
+    for (;;) {
+        struct pollfd pfd[1 + 2 * MAXCONN] = {{.fd = lfd, .events = POLLIN}};
+        for (int i = 0; i < nconn; i++) {
+            pfd[1 + 2 * i] = (struct pollfd){.fd = conns[i].cfd, .events = POLLIN};
+            pfd[2 + 2 * i] = (struct pollfd){.fd = conns[i].sfd, .events = POLLIN};
+        }
+        if (poll(pfd, 1 + 2 * nconn, -1) < 0) continue;
+        if (pfd[0].revents & POLLIN) {
+            int cfd = accept(lfd, NULL, NULL), sfd = -1;
+            if (cfd >= 0 && (nconn == MAXCONN || (sfd = xsocket(real_display, 0)) < 0)) close(cfd);
+            else if (cfd >= 0) conns[nconn++] = (Conn){.cfd = cfd, .sfd = sfd, .up.setup = 1, .down.setup = 1};
+        }
+        for (int i = nconn - 1; i >= 0; i--) {
+            Conn *c = &conns[i];
+            int dead = 0;
+            for (int dir = 0; dir < 2 && !dead; dir++) {
+                if (!(pfd[1 + 2 * i + dir].revents & (POLLIN | POLLHUP))) continue;
+                ssize_t r = read(dir ? c->sfd : c->cfd, buf, sizeof(buf));
+                if (r <= 0) {
+                    dead = 1;
+                    break;
+                }
+                if (dir) scan_down(&c->down, c->up.order, buf, r);
+                else scan_up(&c->up, buf, r);
+                __atomic_store_n(&last_activity, now_us(), __ATOMIC_RELAXED);
+                if (writeall(dir ? c->cfd : c->sfd, buf, r) < 0) dead = 1;
+            }
+            if (dead) {
+                close(c->cfd);
+                close(c->sfd);
+                conns[i] = conns[--nconn];
+            }
+        }
+    }
+    return NULL;
+}
+
+static int winindex(Window w) {
+    for (int i = 0; i < nwins; i++)
+        if (wins[i] == w) return i;
+    return -1;
+}
+
+static void handle(XEvent *ev) {
+    int i;
+    switch (ev->type) {
+    case ConfigureNotify:
+        /* restacking also sends ConfigureNotify, only count geometry changes */
+        if ((i = winindex(ev->xconfigure.window)) >= 0 &&
+            (ev->xconfigure.x != geom[i].x || ev->xconfigure.y != geom[i].y ||
+             ev->xconfigure.width != geom[i].width || ev->xconfigure.height != geom[i].height)) {
+            geom[i] = (XRectangle){ev->xconfigure.x, ev->xconfigure.y, ev->xconfigure.width, ev->xconfigure.height};
+            if (!wstate[i]) tally.configured++;
+            wstate[i] = 1;
+        }
+        break;
+    case MapNotify:
+        if (winindex(ev->xmap.window) >= 0) tally.maps++;
+        break;
+    case UnmapNotify:
+        if (winindex(ev->xunmap.window) >= 0) tally.unmaps++;
+        break;
+    case FocusIn:
+        if (ev->xfocus.mode == NotifyNormal && winindex(ev->xfocus.window) >= 0) tally.focusin++;
+        break;
+    }
+}
+
+static void reset(void) {
+    memset(&tally, 0, sizeof(tally));
+    memset(wstate, 0, nwins * sizeof(*wstate));
+}
+
+/* process events until *field reaches target; returns elapsed us or -1 */
+static long wait_for(int *field, int target, long start) {
+    while (*field < target) {
+        long left = TIMEOUT_MS - (now_us() - start) / 1000;
+        if (left <= 0) return -1;
+        if (!XPending(dpy)) {
+            struct pollfd pfd = {.fd = ConnectionNumber(dpy), .events = POLLIN};
+            poll(&pfd, 1, left);
+            continue;
+        }
+        XEvent ev;
+        XNextEvent(dpy, &ev);
+        handle(&ev);
+    }
+    return now_us() - start;
+}
+
+/* wait until eowm has been silent for IDLE_MS so request counts are complete */
+static void wait_idle(void) {
+    long start = now_us();
+    while (now_us() - __atomic_load_n(&last_activity, __ATOMIC_RELAXED) < IDLE_MS * 1000L &&
+           now_us() - start < TIMEOUT_MS * 1000L)
+        usleep(1000);
+    while (XPending(dpy)) {
+        XEvent ev;
+        XNextEvent(dpy, &ev);
+        handle(&ev);
+    }
+}
+
+static Window mkwin(void) {
+    Window w = XCreateSimpleWindow(dpy, root, 0, 0, INIT_SIZE, INIT_SIZE, 0, 0, 0);
+    XSelectInput(dpy, w, StructureNotifyMask | FocusChangeMask);
+    wins[nwins] = w;
+    geom[nwins] = (XRectangle){0, 0, INIT_SIZE, INIT_SIZE};
+    wstate[nwins++] = 0;
+    return w;
+}
+
+static void key(KeySym sym) {
+    KeyCode mod = XKeysymToKeycode(dpy, XK_Alt_L), k = XKeysymToKeycode(dpy, sym);
+    XTestFakeKeyEvent(dpy, mod, True, CurrentTime);
+    XTestFakeKeyEvent(dpy, k, True, CurrentTime);
+    XTestFakeKeyEvent(dpy, k, False, CurrentTime);
+    XTestFakeKeyEvent(dpy, mod, False, CurrentTime);
+    XFlush(dpy);
+}
+
+static void record(Sample *s, long us, unsigned long req0, unsigned long rep0) {
+    wait_idle();
+    if (us < 0 || s->count == MAXSAMPLES) return;
+    s->us[s->count++] = us;
+    s->requests += nrequests - req0;
+    s->replies += nreplies - rep0;
+}
+
+static int cmplong(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(Sample *s) {
+    if (!s->count) {
+        printf("{\"n\":%d,\"op\":\"%s\",\"samples\":0,\"error\":\"timeout\"}\n", s->n, s->op);
+        return;
+    }
+    long sum = 0;
+    qsort(s->us, s->count, sizeof(long), cmplong);
+    for (int i = 0; i < s->count; i++) sum += s->us[i];
+    printf("{\"n\":%d,\"op\":\"%s\",\"samples\":%d,\"mean_us\":%ld,\"p50_us\":%ld,\"p95_us\":%ld,"
+           "\"max_us\":%ld,\"requests\":%.1f,\"replies\":%.1f}\n",
+           s->n, s->op, s->count, sum / s->count, s->us[s->count / 2], s->us[s->count * 95 / 100],
+           s->us[s->count - 1], (double)s->requests / s->count, (double)s->replies / s->count);
+    fflush(stdout);
+}
+
+static pid_t start_eowm(void) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char d[32];
+        snprintf(d, sizeof(d), ":%d", proxy_display);
+        setenv("DISPLAY", d, 1);
+        execl(eowm_path, eowm_path, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void run(int n) {
+    Sample start = {.op = "startup_scan", .n = n}, map = {.op = "map", .n = n};
+    Sample sws = {.op = "switchws", .n = n}, next = {.op = "nextwin", .n = n};
+    Sample prev = {.op = "prevwin", .n = n}, arr = {.op = "arrange", .n = n};
+    unsigned long req0, rep0;
+    long t;
+
+    nwins = 0;
+    wins = calloc(n + samples + 1, sizeof(*wins));
+    geom = calloc(n + samples + 1, sizeof(*geom));
+    wstate = calloc(n + samples + 1, sizeof(*wstate));
+    if (!wins || !geom || !wstate) die("out of memory");
+    for (int i = 0; i < n; i++) XMapWindow(dpy, mkwin());
+    XSync(dpy, False);
+    XTestFakeMotionEvent(dpy, -1, 0, 0, CurrentTime);
+    wait_idle();
+
+    reset();
+    req0 = nrequests; rep0 = nreplies;
+    t = now_us();
+    pid_t pid = start_eowm();
+    record(&start, wait_for(&tally.configured, n, t), req0, rep0);
+
+    for (int i = 0; i < samples; i++) {
+        Window w = mkwin();
+        reset();
+        req0 = nrequests; rep0 = nreplies;
+        t = now_us();
+        XMapWindow(dpy, w);
+        XFlush(dpy);
+        record(&map, wait_for(&wstate[nwins - 1], 1, t), req0, rep0);
+        XDestroyWindow(dpy, w);
+        nwins--;
+        wait_idle();
+    }
+
+    for (int i = 0; i < samples; i++) {
+        reset();
+        req0 = nrequests; rep0 = nreplies;
+        t = now_us();
+        key(XK_2);
+        record(&sws, wait_for(&tally.unmaps, n, t), req0, rep0);
+        reset();
+        req0 = nrequests; rep0 = nreplies;
+        t = now_us();
+        key(XK_1);
+        record(&sws, wait_for(&tally.maps, n, t), req0, rep0);
+    }
+
+    for (int i = 0; i < samples; i++) {
+        reset();
+        req0 = nrequests; rep0 = nreplies;
+        t = now_us();
+        key(XK_j);
+        record(&next, wait_for(&tally.focusin, 1, t), req0, rep0);
+        reset();
+        req0 = nrequests; rep0 = nreplies;
+        t = now_us();
+        key(XK_k);
+        record(&prev, wait_for(&tally.focusin, 1, t), req0, rep0);
+    }
+
+    /* alternate inc/dec so master_size never hits its clamp */
+    for (int i = 0; i < samples; i++) {
+        reset();
+        req0 = nrequests; rep0 = nreplies;
+        t = now_us();
+        key(i % 2 ? XK_l : XK_h);
+        record(&arr, wait_for(&tally.configured, n, t), req0, rep0);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    for (int i = 0; i < nwins; i++) XDestroyWindow(dpy, wins[i]);
+    XSync(dpy, False);
+    free(wins);
+    free(geom);
+    free(wstate);
+
+    Sample *all[] = {&start, &map, &sws, &next, &prev, &arr};
+    for (size_t i = 0; i < LENGTH(all); i++) report(all[i]);
+}
+
+int main(int argc, char *argv[]) {
+    int counts[16], ncounts = 0, opt;
+    pthread_t th;
+
+    while ((opt = getopt(argc, argv, "d:p:e:n:s:")) != -1) {
+        switch (opt) {
+        case 'd': real_display = atoi(optarg); break;
+        case 'p': proxy_display = atoi(optarg); break;
+        case 'e': eowm_path = optarg; break;
+        case 'n': if (ncounts < (int)LENGTH(counts)) counts[ncounts++] = atoi(optarg); break;
+        case 's': samples = atoi(optarg); break;
+        default: die("usage: xbench [-d display] [-p proxy display] [-e eowm] [-n clients]... [-s samples]");
+        }
+    }
+    if (samples < 1 || samples > MAXSAMPLES) die("samples must be 1..%d", MAXSAMPLES);
+    if (!ncounts) {
+        counts[ncounts++] = 10;
+        counts[ncounts++] = 100;
+        counts[ncounts++] = 500;
+    }
+
+    char d[32];
+    snprintf(d, sizeof(d), ":%d", real_display);
+    if (!(dpy = XOpenDisplay(d))) die("xbench: cannot open display %s", d);
+    root = DefaultRootWindow(dpy);
+
+    static int lfd;
+    if ((lfd = xsocket(proxy_display, 1)) < 0) die("xbench: cannot listen on display :%d, is it in use?", proxy_display);
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&th, NULL, proxy, &lfd);
+
+    for (int i = 0; i < ncounts; i++) run(counts[i]);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/.X11-unix/X%d", proxy_display);
+    unlink(path);
+    XCloseDisplay(dpy);
+    return 0;
+}
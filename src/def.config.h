@@ -17,6 +17,7 @@ static const char col_border_normal[]  = "#999999";
 static Key keys[] = {
     { MOD,           XK_j,      nextwin,            {0} },
     { MOD,           XK_k,      prevwin,            {0} },
+    { MOD,           XK_Tab,    focuslast,          {0} },
     { MOD,           XK_f,      fullscreen,         {0} },
     { MOD,           XK_q,      killclient,         {0} },
     { MOD,           XK_c,      quit,               {0} },
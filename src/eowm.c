@@ -1,48 +1,191 @@
 /* eowm - eet owter winvow manade */
+#define _GNU_SOURCE
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
 #include <X11/Xatom.h>
 #include <X11/cursorfont.h>
 #include <X11/extensions/Xrandr.h>
+#include <xcb/xcb.h>
+#include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
 #include <stdarg.h>
 
+#include "layout.h"
+
 #define LENGTH(X) (sizeof(X) / sizeof(X[0]))
 #define NUM_WS 9
-#define CLEANMASK(mask) (mask & ~(LockMask | Mod2Mask))
+#define CLEANMASK(mask) (mask & ~(numlockmask | LockMask) & \
+                         (ShiftMask | ControlMask | Mod1Mask | Mod2Mask | Mod3Mask | Mod4Mask | Mod5Mask))
+#define POOL_SLAB 64
+#define STAT_BUCKETS 24
+#define IPC_MAX_CLIENTS 16
+#define IPC_BUFSIZE 4096
+#define IPC_TIMEOUT_MS 10000
+#define TIMER_TICK_MS 4
+#define SPAWN_MAXARGS 32
+#define WHEEL_SIZE 256
+#define KEYTAB_SIZE 512
+#define KEYHASH(code) (((code) * 2654435761U) >> 23 & (KEYTAB_SIZE - 1))
+#define HASH_SIZE 256
+#define WINHASH(w) ((unsigned long)(w) * 2654435761UL % HASH_SIZE)
+#define TRACE_MAGIC "EOWMTRC1"
+#define TRACE_RECORDS 32768
+#define TRACE_BATCH_END 1
+#define TRACE_WINDOWS 4096
+#define FRAME_MS 16 /* drag update interval when the refresh rate is unknown */
+
+enum { StatArrange, StatArrangeMonitor, StatFocus, StatUpdateMonitors, StatMaprequest, StatLast };
+
+enum {
+    WMProtocols, WMDelete, NetWMState, NetWMStateFullscreen,
+    NetWMWindowType, NetWMWindowTypeDialog, NetWMWindowTypeDock,
+    NetWMWindowTypeNotification, NetWMWindowTypeSplash,
+    NetWMStrut, NetWMStrutPartial, NetSupported, NetSupportingWMCheck,
+    NetWMName, UTF8String, NetClientList, NetActiveWindow,
+    NetNumberOfDesktops, NetCurrentDesktop, NetWMDesktop, AtomLast
+};
 
 typedef struct Client Client;
+typedef struct Monitor Monitor;
 struct Client {
-    Window win;
+    /* fields read by every layout pass come first and share a cache line */
     int x, y, w, h;
-    int ws, isfullscreen, ishidden, isfloating;
-    Client *next;
+    int isfloating, isfullscreen, ishidden, ismapped;
+    int sx, sy, sw, sh, sbw; /* last geometry sent to the server */
+    int ws, idx; /* workspace and position in mon->ws[ws].clients[] */
+    int desktop; /* last _NET_WM_DESKTOP written */
+    Monitor *mon;
+    Window win;
+    Client *hnext;
+    Client *mru_prev, *mru_next; /* per-workspace focus history, most recent first */
+    /* ConfigureRequests merged until the end of the batch */
+    int req_x, req_y, req_w, req_h, req_pending;
+    unsigned long req_mask;
+    Client *req_next;
 };
 
+/* one monitor's share of a workspace: the first tiled client is the master,
+ * the rest is the stack top to bottom */
+typedef struct {
+    Client **clients;
+    int n, cap;
+} Workspace;
+
 typedef struct StrutWindow StrutWindow;
 struct StrutWindow {
     Window win;
-    long struts[4];
-    StrutWindow *next;
+    long struts[12]; /* _NET_WM_STRUT_PARTIAL layout */
+    StrutWindow *next, *hnext;
 };
 
-typedef struct Monitor Monitor;
 struct Monitor {
     int x, y, w, h, num;
+    RROutput output; /* identity across RandR changes, None for the fallback */
+    int dirty; /* needs a layout pass at the end of the batch */
+    double master_size;
+    int frame_ms; /* refresh interval, paces drag updates */
+    int struts[4]; /* reserved by docks on this head: left, right, top, bottom */
+    Workspace ws[NUM_WS];
     Monitor *next;
 };
 
+/* fixed-size object allocator: slabs of POOL_SLAB objects, threaded freelist */
+typedef struct {
+    const char *name;
+    size_t size;
+    void *freelist, *slabs;
+    unsigned long live, peak;
+} Pool;
+
+/* per hot path: calls, X traffic and a log2 histogram of latency in us */
+typedef struct {
+    const char *name;
+    unsigned long calls, requests, roundtrips, total_us;
+    unsigned long hist[STAT_BUCKETS];
+} Stat;
+
+typedef struct {
+    long us;
+    unsigned long request, roundtrips;
+} StatMark;
+
+/* mmap'd event trace: header, then a ring of capacity records */
+typedef struct {
+    char magic[8];
+    uint32_t record_size, capacity;
+    uint64_t root, head; /* recording root, records ever written */
+} TraceHeader;
+
+typedef struct {
+    uint64_t time_ns; /* CLOCK_MONOTONIC when the event was read */
+    uint32_t handler_ns;
+    uint32_t flags; /* TRACE_BATCH_END: last event before a layout pass */
+    XEvent ev;
+} TraceRecord;
+
+/* requests in flight for one window being admitted */
+typedef struct {
+    Window win;
+    xcb_get_window_attributes_cookie_t attr;
+    xcb_get_geometry_cookie_t geom;
+    xcb_get_property_cookie_t type, strut_partial, strut, transient;
+} Admission;
+
 typedef union {
     int i;
     const char *cmd;
 } Arg;
 
+typedef struct {
+    const char *name;
+    void (*func)(const Arg *);
+    int argtype; /* 0 none, 1 int, 2 string */
+} Command;
+
+/* one-shot timer, owned by the caller and hashed into the wheel by tick */
+typedef struct Timer Timer;
+struct Timer {
+    unsigned long expires;
+    void (*func)(void *);
+    void *arg;
+    Timer *next, **pprev;
+};
+
+/* Mod+drag of a floating client, geometry relative to where it started */
+typedef struct {
+    Client *c;
+    int resizing;
+    int px, py, x, y, w, h; /* pointer and client at the press */
+    int mx, my; /* latest pointer */
+    long last_us; /* when geometry was last sent */
+    Timer timer;
+} Drag;
+
+typedef struct {
+    int fd, len;
+    Timer timeout;
+    char buf[IPC_BUFSIZE];
+} IpcClient;
+
 typedef struct {
     unsigned int mod;
     KeySym keysym;
@@ -50,16 +193,112 @@ typedef struct {
     const Arg arg;
 } Key;
 
+/* spawn command split once at startup, argv[0] is NULL if it needs a shell */
+typedef struct {
+    const char *cmd;
+    char *buf;
+    char *argv[SPAWN_MAXARGS + 1];
+} SpawnCmd;
+
+extern char **environ;
+
 static Display *dpy;
+static xcb_connection_t *xc;
 static Window root;
-static Client *focused, *workspaces[NUM_WS], *last_focused[NUM_WS];
+static Client *focused, *mru[NUM_WS];
+static Client *client_hash[HASH_SIZE];
 static Monitor *monitors, *current_monitor;
-static StrutWindow *strut_windows;
+static StrutWindow *strut_windows, *strut_hash[HASH_SIZE];
+static Pool client_pool = {.name = "Client", .size = sizeof(Client)};
+static Pool strut_pool = {.name = "StrutWindow", .size = sizeof(StrutWindow)};
+static Pool monitor_pool = {.name = "Monitor", .size = sizeof(Monitor)};
 static int screen, sw, sh, current_ws, monitor_count;
-static int global_struts[4];
-static double master_size;
+static int rr_event_base = -1;
 static unsigned long border_normal, border_focused;
-static Atom net_wm_strut, net_wm_strut_partial, net_wm_window_type;
+static unsigned int numlockmask;
+static unsigned long skipped_requests, arranges_requested, arranges_performed;
+static int arrange_pending;
+static Client *configure_pending;
+static Drag drag;
+/* crossings carrying a serial in [enter_from, enter_to) were caused by our
+ * own requests; last_serial is the newest serial read from the server */
+static unsigned long batch_serial, enter_from, enter_to, last_serial;
+static unsigned long enters_ignored;
+static Cursor cursor_normal, cursor_move, cursor_resize;
+static unsigned long configures_requested, configures_answered;
+static Rect *layout_geom;
+static int layout_cap;
+static Window wmcheck, *ewmh_clients, ewmh_active = ~0UL; /* ewmh_clients in mapping order */
+static int ewmh_nclients, ewmh_cap, ewmh_desktop = -1, ewmh_dirty, ewmh_desktops_dirty;
+static int stats_enabled;
+static int signal_fd = -1, timer_fd = -1, ntimers;
+static sigset_t orig_sigmask;
+static Timer *wheel[WHEEL_SIZE];
+static unsigned long wheel_tick;
+static unsigned long timer_armed; /* tick the timerfd fires at, 0 if disarmed */
+static unsigned long roundtrips;
+static Stat event_stats[LASTEvent] = {
+    [ButtonPress] = {.name = "ButtonPress"},
+    [ConfigureRequest] = {.name = "ConfigureRequest"},
+    [MapRequest] = {.name = "MapRequest"},
+    [MapNotify] = {.name = "MapNotify"},
+    [UnmapNotify] = {.name = "UnmapNotify"},
+    [DestroyNotify] = {.name = "DestroyNotify"},
+    [EnterNotify] = {.name = "EnterNotify"},
+    [KeyPress] = {.name = "KeyPress"},
+    [MappingNotify] = {.name = "MappingNotify"},
+    [MotionNotify] = {.name = "MotionNotify"},
+    [PropertyNotify] = {.name = "PropertyNotify"},
+    [ButtonRelease] = {.name = "ButtonRelease"},
+};
+static Stat fn_stats[StatLast] = {
+    [StatArrange] = {.name = "arrange"},
+    [StatArrangeMonitor] = {.name = "arrange_monitor"},
+    [StatFocus] = {.name = "focus"},
+    [StatUpdateMonitors] = {.name = "update_monitors"},
+    [StatMaprequest] = {.name = "maprequest"},
+};
+static Atom atoms[AtomLast];
+static const char *atom_names[AtomLast] = {
+    [WMProtocols] = "WM_PROTOCOLS",
+    [WMDelete] = "WM_DELETE_WINDOW",
+    [NetWMState] = "_NET_WM_STATE",
+    [NetWMStateFullscreen] = "_NET_WM_STATE_FULLSCREEN",
+    [NetWMWindowType] = "_NET_WM_WINDOW_TYPE",
+    [NetWMWindowTypeDialog] = "_NET_WM_WINDOW_TYPE_DIALOG",
+    [NetWMWindowTypeDock] = "_NET_WM_WINDOW_TYPE_DOCK",
+    [NetWMWindowTypeNotification] = "_NET_WM_WINDOW_TYPE_NOTIFICATION",
+    [NetWMWindowTypeSplash] = "_NET_WM_WINDOW_TYPE_SPLASH",
+    [NetWMStrut] = "_NET_WM_STRUT",
+    [NetWMStrutPartial] = "_NET_WM_STRUT_PARTIAL",
+    [NetSupported] = "_NET_SUPPORTED",
+    [NetSupportingWMCheck] = "_NET_SUPPORTING_WM_CHECK",
+    [NetWMName] = "_NET_WM_NAME",
+    [UTF8String] = "UTF8_STRING",
+    [NetClientList] = "_NET_CLIENT_LIST",
+    [NetActiveWindow] = "_NET_ACTIVE_WINDOW",
+    [NetNumberOfDesktops] = "_NET_NUMBER_OF_DESKTOPS",
+    [NetCurrentDesktop] = "_NET_CURRENT_DESKTOP",
+    [NetWMDesktop] = "_NET_WM_DESKTOP",
+};
+
+static int nspawn_cmds;
+static int ipc_fd = -1;
+static IpcClient ipc_clients[IPC_MAX_CLIENTS];
+static char ipc_out[IPC_BUFSIZE]; /* reply being built for the client in ipc_read */
+static int ipc_outlen;
+static struct sockaddr_un ipc_addr;
+static struct {
+    Window from, to;
+} replay_map[TRACE_WINDOWS];
+static TraceHeader *trace;
+static TraceRecord *trace_records;
+static int replaying;
+
+static struct {
+    unsigned int code; /* keycode << 8 | cleaned modifier */
+    const Key *key;
+} keytab[KEYTAB_SIZE];
 
 static void focus_monitor(const Arg *arg);
 static void movewin_to_monitor(const Arg *arg);
@@ -73,11 +312,16 @@ static void movewin(const Arg *arg);
 static void switchws(const Arg *arg);
 static void movewin_to_ws(const Arg *arg);
 static void fullscreen(const Arg *arg);
+static void focuslast(const Arg *arg);
 static void quit(const Arg *arg);
 static void spawn(const Arg *arg);
+static TraceRecord *trace_record(const XEvent *ev);
+static void resize(Client *c, int x, int y, int w, int h);
 
 #include "config.h"
 
+static SpawnCmd spawn_cmds[LENGTH(keys)];
+
 static void die(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -93,9 +337,139 @@ static unsigned long getcolor(const char *hex) {
     return (XParseColor(dpy, cmap, hex, &color) && XAllocColor(dpy, cmap, &color)) ? color.pixel : 0;
 }
 
-static void sigchld_handler(int sig) {
-    (void)sig;
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static long now_us(void) {
+    return now_ns() / 1000;
+}
+
+static unsigned long current_tick(void) {
+    return now_us() / 1000 / TIMER_TICK_MS;
+}
+
+/* arm the timerfd for tick, or disarm it for 0 */
+static void timer_arm(unsigned long tick) {
+    struct itimerspec its = {0};
+    unsigned long now = current_tick();
+    if (tick) {
+        long ms = tick > now ? (long)(tick - now) * TIMER_TICK_MS : 1;
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = ms % 1000 * 1000000L;
+    }
+    timerfd_settime(timer_fd, 0, &its, NULL);
+    timer_armed = tick;
+}
+
+/* full scan for the earliest expiry, only after timers fired */
+static void timer_rearm(void) {
+    unsigned long next = 0;
+    for (int i = 0; i < WHEEL_SIZE && ntimers; i++)
+        for (Timer *t = wheel[i]; t; t = t->next)
+            if (!next || t->expires < next) next = t->expires;
+    timer_arm(next);
+}
+
+static void timer_unlink(Timer *t) {
+    if (!t->pprev) return;
+    if (t->next) t->next->pprev = t->pprev;
+    *t->pprev = t->next;
+    t->pprev = NULL;
+}
+
+static void timer_del(Timer *t) {
+    if (!t->pprev) return;
+    timer_unlink(t);
+    /* an armed expiry that is now too early only costs a spurious timer_run */
+    if (!--ntimers) timer_arm(0);
+}
+
+static void timer_add(Timer *t, long ms, void (*func)(void *), void *arg) {
+    if (t->pprev) timer_unlink(t);
+    else ntimers++;
+    unsigned long now = current_tick(), ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (ntimers == 1) wheel_tick = now;
+    t->expires = now + (ticks ? ticks : 1);
+    t->func = func;
+    t->arg = arg;
+    Timer **slot = &wheel[t->expires % WHEEL_SIZE];
+    if ((t->next = *slot)) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    if (!timer_armed || t->expires < timer_armed) timer_arm(t->expires);
+}
+
+/* collect everything due first, callbacks may add or delete timers */
+static void timer_run(void) {
+    uint64_t n;
+    Timer *expired = NULL, *t;
+    if (read(timer_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) return;
+    unsigned long now = current_tick(), span = now - wheel_tick + 1;
+    if (span > WHEEL_SIZE) span = WHEEL_SIZE;
+    for (unsigned long i = 0; i < span; i++) {
+        Timer *next;
+        for (t = wheel[(wheel_tick + i) % WHEEL_SIZE]; t; t = next) {
+            next = t->next;
+            if (t->expires > now) continue;
+            timer_unlink(t);
+            if ((t->next = expired)) expired->pprev = &t->next;
+            t->pprev = &expired;
+            expired = t;
+        }
+    }
+    wheel_tick = now + 1;
+    while ((t = expired)) {
+        timer_unlink(t);
+        ntimers--;
+        t->func(t->arg);
+    }
+    timer_rearm();
+}
+
+/* requests are counted from Xlib sequence numbers, round-trips at call sites */
+static StatMark stat_begin(void) {
+    if (!stats_enabled) return (StatMark){0};
+    return (StatMark){now_us(), NextRequest(dpy), roundtrips};
+}
+
+static void stat_end(Stat *s, StatMark m) {
+    if (!stats_enabled) return;
+    unsigned long us = now_us() - m.us;
+    int b = 0;
+    while (b < STAT_BUCKETS - 1 && (1UL << b) <= us) b++;
+    s->calls++;
+    s->total_us += us;
+    s->requests += NextRequest(dpy) - m.request;
+    s->roundtrips += roundtrips - m.roundtrips;
+    s->hist[b]++;
+}
+
+static void print_stat(const Stat *s) {
+    if (!s->calls) return;
+    fprintf(stderr, "%-18s calls %-8lu avg %6luus  req %-8lu rt %-6lu", s->name ? s->name : "other", s->calls,
+            s->total_us / s->calls, s->requests, s->roundtrips);
+    for (int b = 0; b < STAT_BUCKETS; b++)
+        if (s->hist[b]) fprintf(stderr, " <%luus:%lu", 1UL << b, s->hist[b]);
+    fputc('\n', stderr);
+}
+
+static void dump_stats(void) {
+    fprintf(stderr, "eowm: %lu arranges requested, %lu performed, %lu redundant requests skipped\n",
+            arranges_requested, arranges_performed, skipped_requests);
+    fprintf(stderr, "eowm: %lu configure requests from clients, %lu answered\n",
+            configures_requested, configures_answered);
+    fprintf(stderr, "eowm: %lu crossings from our own requests ignored\n", enters_ignored);
+    const Pool *pools[] = {&client_pool, &strut_pool, &monitor_pool};
+    for (size_t i = 0; i < LENGTH(pools); i++)
+        fprintf(stderr, "eowm: %s pool: %lu live, %lu peak\n", pools[i]->name, pools[i]->live, pools[i]->peak);
+    if (!stats_enabled) return;
+    for (int i = 0; i < LASTEvent; i++)
+        print_stat(&event_stats[i]);
+    for (int i = 0; i < StatLast; i++)
+        print_stat(&fn_stats[i]);
 }
 
 static int xerror(Display *dpy, XErrorEvent *ee) {
@@ -105,61 +479,91 @@ static int xerror(Display *dpy, XErrorEvent *ee) {
     return 0;
 }
 
-static void update_struts(void) {
-    memset(global_struts, 0, sizeof(global_struts));
-    for (StrutWindow *s = strut_windows; s; s = s->next)
-        for (int i = 0; i < 4; i++)
-            if (s->struts[i] > global_struts[i])
-                global_struts[i] = s->struts[i];
+static void* pool_alloc(Pool *p) {
+    if (!p->freelist) {
+        /* slot 0 links the slab into p->slabs, the rest go on the freelist */
+        char *slab = calloc(POOL_SLAB + 1, p->size);
+        if (!slab) return NULL;
+        *(void **)slab = p->slabs;
+        p->slabs = slab;
+        for (int i = POOL_SLAB; i > 0; i--) {
+            *(void **)(slab + i * p->size) = p->freelist;
+            p->freelist = slab + i * p->size;
+        }
+    }
+    void *o = p->freelist;
+    p->freelist = *(void **)o;
+    memset(o, 0, p->size);
+    if (++p->live > p->peak) p->peak = p->live;
+    return o;
 }
 
-static void remove_strut_window(Window win) {
-    for (StrutWindow **p = &strut_windows; *p; p = &(*p)->next) {
-        if ((*p)->win == win) {
-            StrutWindow *tmp = *p;
-            *p = tmp->next;
-            free(tmp);
-            update_struts();
+static void pool_free(Pool *p, void *o) {
+    if (!o) return;
+    *(void **)o = p->freelist;
+    p->freelist = o;
+    p->live--;
+}
+
+static void pool_destroy(Pool *p) {
+    while (p->slabs) {
+        void *next = *(void **)p->slabs;
+        free(p->slabs);
+        p->slabs = next;
+    }
+    p->freelist = NULL;
+    p->live = 0;
+}
+
+static Client* wintoclient(Window win) {
+    Client *c = client_hash[WINHASH(win)];
+    while (c && c->win != win) c = c->hnext;
+    return c;
+}
+
+static void hash_client(Client *c) {
+    Client **b = &client_hash[WINHASH(c->win)];
+    c->hnext = *b;
+    *b = c;
+}
+
+static void unhash_client(Client *c) {
+    for (Client **p = &client_hash[WINHASH(c->win)]; *p; p = &(*p)->hnext) {
+        if (*p == c) {
+            *p = c->hnext;
             return;
         }
     }
 }
 
-static int get_window_struts(Window win, long struts[4]) {
-    Atom types[] = {net_wm_strut_partial, net_wm_strut};
-    for (int t = 0; t < 2; t++) {
-        Atom actual;
-        int fmt;
-        unsigned long n, after;
-        unsigned char *data = NULL;
-        if (XGetWindowProperty(dpy, win, types[t], 0, 4, False, XA_CARDINAL,
-                               &actual, &fmt, &n, &after, &data) == Success && data) {
-            if (actual == XA_CARDINAL && fmt == 32 && n >= 4) {
-                int has = 0;
-                for (int i = 0; i < 4; i++) {
-                    struts[i] = ((long *)data)[i];
-                    if (struts[i] > 0) has = 1;
-                }
-                XFree(data);
-                return has;
-            }
-            XFree(data);
+static StrutWindow* wintostrut(Window win) {
+    StrutWindow *s = strut_hash[WINHASH(win)];
+    while (s && s->win != win) s = s->hnext;
+    return s;
+}
+
+static void hash_strut(StrutWindow *s) {
+    StrutWindow **b = &strut_hash[WINHASH(s->win)];
+    s->hnext = *b;
+    *b = s;
+}
+
+static void unhash_strut(StrutWindow *s) {
+    for (StrutWindow **p = &strut_hash[WINHASH(s->win)]; *p; p = &(*p)->hnext) {
+        if (*p == s) {
+            *p = s->hnext;
+            return;
         }
     }
-    return 0;
 }
 
-static int check_window_type(Window win, const char *type_name) {
-    Atom actual;
-    int fmt;
-    unsigned long n, after;
-    unsigned char *prop = NULL;
-    if (XGetWindowProperty(dpy, win, net_wm_window_type, 0, 1, False, XA_ATOM,
-                           &actual, &fmt, &n, &after, &prop) == Success && prop) {
-        int match = (*(Atom *)prop == XInternAtom(dpy, type_name, False));
-        XFree(prop);
-        return match;
-    }
+/* true if any of the window's _NET_WM_WINDOW_TYPE entries is in want[] */
+static int reply_has_type(xcb_get_property_reply_t *r, const Atom *want, int nwant) {
+    if (!r || r->type != XCB_ATOM_ATOM || r->format != 32) return 0;
+    uint32_t *v = xcb_get_property_value(r);
+    for (uint32_t i = 0; i < r->value_len; i++)
+        for (int j = 0; j < nwant; j++)
+            if (v[i] == want[j]) return 1;
     return 0;
 }
 
@@ -170,8 +574,18 @@ static Monitor* get_monitor_at(int x, int y) {
     return monitors;
 }
 
-static Monitor* get_monitor_for_window(Client *c) {
-    return get_monitor_at(c->x + c->w / 2, c->y + c->h / 2);
+/* fit a floating rect into m minus what docks reserve, unless they leave no room */
+static void clamp_to_monitor(const Monitor *m, int *x, int *y, int *w, int *h) {
+    int ax = m->x + m->struts[0], aw = m->w - m->struts[0] - m->struts[1];
+    int ay = m->y + m->struts[2], ah = m->h - m->struts[2] - m->struts[3];
+    if (aw < 1) ax = m->x, aw = m->w;
+    if (ah < 1) ay = m->y, ah = m->h;
+    if (*w > aw) *w = aw;
+    if (*h > ah) *h = ah;
+    if (*x + *w > ax + aw) *x = ax + aw - *w;
+    if (*y + *h > ay + ah) *y = ay + ah - *h;
+    if (*x < ax) *x = ax;
+    if (*y < ay) *y = ay;
 }
 
 static Monitor* cycle_monitor(Monitor *cur, int dir) {
@@ -185,208 +599,637 @@ static Monitor* cycle_monitor(Monitor *cur, int dir) {
     return (!cur || cur == monitors) ? m : prev;
 }
 
-static void update_monitors(void) {
-    while (monitors) {
-        Monitor *m = monitors->next;
-        free(monitors);
-        monitors = m;
+/* mark m (every monitor if NULL) for a layout pass once the current event
+ * batch is drained */
+static void arrange(Monitor *m) {
+    if (m) {
+        m->dirty = 1;
+    } else {
+        for (m = monitors; m; m = m->next)
+            m->dirty = 1;
     }
+    arrange_pending = 1;
+    arranges_requested++;
+}
+
+static int ws_reserve(Workspace *w) {
+    if (w->n < w->cap) return 1;
+    int cap = w->cap ? w->cap * 2 : 16;
+    Client **p = realloc(w->clients, cap * sizeof(Client *));
+    if (!p) return 0;
+    w->clients = p;
+    w->cap = cap;
+    return 1;
+}
+
+/* put c at pos in m's share of ws, pos < 0 appends */
+static int attach(Client *c, Monitor *m, int ws, int pos) {
+    Workspace *w = &m->ws[ws];
+    if (!ws_reserve(w)) return 0;
+    if (pos < 0) pos = w->n;
+    memmove(&w->clients[pos + 1], &w->clients[pos], (w->n - pos) * sizeof(Client *));
+    w->clients[pos] = c;
+    w->n++;
+    c->mon = m;
+    c->ws = ws;
+    for (int i = pos; i < w->n; i++) w->clients[i]->idx = i;
+    return 1;
+}
+
+static void detach(Client *c) {
+    Workspace *w = &c->mon->ws[c->ws];
+    memmove(&w->clients[c->idx], &w->clients[c->idx + 1], (w->n - c->idx - 1) * sizeof(Client *));
+    w->n--;
+    for (int i = c->idx; i < w->n; i++) w->clients[i]->idx = i;
+}
+
+/* how far strut s reaches into m from each edge. Struts are relative to the
+ * root window, so one counts for the head its inner edge falls on, within
+ * its start/end span */
+static int strut_reach(const long *s, const Monitor *m, int out[4]) {
+    long x1 = m->x + m->w, y1 = m->y + m->h;
+    memset(out, 0, 4 * sizeof(int));
+    if (!s) return 0;
+    long l = s[0], r = sw - s[1], t = s[2], b = sh - s[3];
+    if (s[0] > 0 && l > m->x && l <= x1 && s[4] < y1 && s[5] >= m->y) out[0] = l - m->x;
+    if (s[1] > 0 && r >= m->x && r < x1 && s[6] < y1 && s[7] >= m->y) out[1] = x1 - r;
+    if (s[2] > 0 && t > m->y && t <= y1 && s[8] < x1 && s[9] >= m->x) out[2] = t - m->y;
+    if (s[3] > 0 && b >= m->y && b < y1 && s[10] < x1 && s[11] >= m->x) out[3] = y1 - b;
+    return out[0] || out[1] || out[2] || out[3];
+}
+
+static void update_monitor_struts(Monitor *m) {
+    int st[4] = {0}, r[4];
+    for (StrutWindow *s = strut_windows; s; s = s->next)
+        if (strut_reach(s->struts, m, r))
+            for (int i = 0; i < 4; i++)
+                if (r[i] > st[i]) st[i] = r[i];
+    if (!memcmp(st, m->struts, sizeof(st))) return;
+    memcpy(m->struts, st, sizeof(st));
+    arrange(m);
+}
+
+/* only the heads the old or the new reservation touches are recomputed */
+static void struts_changed(const long *old, const long *new) {
+    int r[4];
+    for (Monitor *m = monitors; m; m = m->next)
+        if (strut_reach(old, m, r) || strut_reach(new, m, r)) update_monitor_struts(m);
+}
+
+static int remove_strut_window(Window win) {
+    StrutWindow *s = wintostrut(win);
+    if (!s) return 0;
+    for (StrutWindow **p = &strut_windows; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    unhash_strut(s);
+    struts_changed(s->struts, NULL);
+    pool_free(&strut_pool, s);
+    return 1;
+}
+
+static int reply_cardinals(xcb_get_property_reply_t *r, long *v, int n) {
+    if (!r || r->type != XCB_ATOM_CARDINAL || r->format != 32 || r->value_len < (uint32_t)n) return 0;
+    uint32_t *p = xcb_get_property_value(r);
+    for (int i = 0; i < n; i++)
+        v[i] = p[i];
+    return 1;
+}
+
+/* _NET_WM_STRUT_PARTIAL, else _NET_WM_STRUT spanning the whole edge */
+static int reply_struts(xcb_get_property_reply_t *partial, xcb_get_property_reply_t *strut, long s[12]) {
+    if (reply_cardinals(partial, s, 12) && (s[0] > 0 || s[1] > 0 || s[2] > 0 || s[3] > 0)) return 1;
+    if (!reply_cardinals(strut, s, 4)) return 0;
+    for (int i = 4; i < 12; i += 2) {
+        s[i] = 0;
+        s[i + 1] = LONG_MAX;
+    }
+    return s[0] > 0 || s[1] > 0 || s[2] > 0 || s[3] > 0;
+}
+
+/* the monitor already showing output, updated in place, or a new one at the
+ * end of the list; either way it is marked as still present */
+static Monitor* update_head(RROutput output, int x, int y, int w, int h) {
+    Monitor *m, **pm;
+    for (m = monitors; m; m = m->next)
+        if (m->num < 0 && m->output == output) break;
+    if (!m) {
+        if (!(m = pool_alloc(&monitor_pool))) die("out of memory");
+        m->output = output;
+        m->master_size = default_master_size;
+        for (pm = &monitors; *pm; pm = &(*pm)->next);
+        *pm = m;
+    }
+    if (m->x != x || m->y != y || m->w != w || m->h != h) {
+        m->x = x; m->y = y; m->w = w; m->h = h;
+        arrange(m);
+    }
+    m->num = monitor_count++;
+    return m;
+}
+
+static int mode_frame_ms(XRRScreenResources *sr, RRMode mode) {
+    for (int i = 0; i < sr->nmode; i++) {
+        XRRModeInfo *mi = &sr->modes[i];
+        if (mi->id != mode || !mi->dotClock) continue;
+        int ms = (int)(1000UL * mi->hTotal * mi->vTotal / mi->dotClock);
+        return ms > 0 ? ms : 1;
+    }
+    return FRAME_MS;
+}
+
+/* diff the active CRTCs against monitors so heads that did not change keep
+ * their clients, order and master size and are not laid out again */
+static void update_monitors(void) {
+    StatMark mark = stat_begin();
+    for (Monitor *m = monitors; m; m = m->next)
+        m->num = -1;
     monitor_count = 0;
-    XRRScreenResources *sr = XRRGetScreenResources(dpy, root);
+
+    XRRScreenResources *sr = rr_event_base >= 0 ? XRRGetScreenResourcesCurrent(dpy, root) : NULL;
+    roundtrips++;
     if (sr) {
         for (int i = 0; i < sr->ncrtc; i++) {
             XRRCrtcInfo *ci = XRRGetCrtcInfo(dpy, sr, sr->crtcs[i]);
-            if (ci && ci->noutput > 0 && ci->width > 0 && ci->height > 0) {
-                Monitor *m = calloc(1, sizeof(Monitor));
-                m->num = monitor_count++;
-                m->x = ci->x; m->y = ci->y; m->w = ci->width; m->h = ci->height;
-                m->next = monitors;
-                monitors = m;
-            }
+            roundtrips++;
+            if (ci && ci->noutput > 0 && ci->width > 0 && ci->height > 0)
+                update_head(ci->outputs[0], ci->x, ci->y, ci->width, ci->height)->frame_ms = mode_frame_ms(sr, ci->mode);
             if (ci) XRRFreeCrtcInfo(ci);
         }
         XRRFreeScreenResources(sr);
     }
-    if (!monitors) {
-        monitors = calloc(1, sizeof(Monitor));
-        monitors->w = sw;
-        monitors->h = sh;
-        monitor_count = 1;
+    if (!monitor_count) update_head(None, 0, 0, sw, sh)->frame_ms = FRAME_MS;
+
+    Monitor *gone = NULL;
+    for (Monitor **pm = &monitors; *pm;) {
+        Monitor *m = *pm;
+        if (m->num >= 0) {
+            pm = &m->next;
+            continue;
+        }
+        *pm = m->next;
+        m->next = gone;
+        gone = m;
     }
-    current_monitor = monitors;
+
+    for (Monitor *m = monitors; m; m = m->next)
+        update_monitor_struts(m);
+
+    /* clients of a vanished head land where their centre is, in stack order;
+     * floating ones off every head keep their offset on the head they join */
+    while (gone) {
+        Monitor *next = gone->next;
+        for (int i = 0; i < NUM_WS; i++) {
+            for (int j = 0; j < gone->ws[i].n; j++) {
+                Client *c = gone->ws[i].clients[j];
+                int cx = c->x + c->w / 2, cy = c->y + c->h / 2;
+                Monitor *to = get_monitor_at(cx, cy);
+                if (!attach(c, to, i, -1)) die("out of memory");
+                arrange(to);
+                if (!c->isfloating || c->isfullscreen) continue;
+                int x = c->x, y = c->y, w = c->w, h = c->h;
+                if (cx < to->x || cx >= to->x + to->w || cy < to->y || cy >= to->y + to->h) {
+                    x += to->x - gone->x;
+                    y += to->y - gone->y;
+                }
+                clamp_to_monitor(to, &x, &y, &w, &h);
+                resize(c, x, y, w, h);
+            }
+            free(gone->ws[i].clients);
+        }
+        if (current_monitor == gone) current_monitor = NULL;
+        pool_free(&monitor_pool, gone);
+        gone = next;
+    }
+    if (!current_monitor) current_monitor = focused ? focused->mon : monitors;
+    stat_end(&fn_stats[StatUpdateMonitors], mark);
 }
 
 static int can_focus(Client *c) {
-    XWindowAttributes wa;
-    return c && !c->ishidden && c->ws == current_ws && XGetWindowAttributes(dpy, c->win, &wa);
+    return c && !c->ishidden && c->ismapped && c->ws == current_ws;
+}
+
+static void mru_unlink(Client *c) {
+    if (c->mru_prev) c->mru_prev->mru_next = c->mru_next;
+    else if (mru[c->ws] == c) mru[c->ws] = c->mru_next;
+    if (c->mru_next) c->mru_next->mru_prev = c->mru_prev;
+    c->mru_prev = c->mru_next = NULL;
+}
+
+static void mru_push(Client *c) {
+    if ((c->mru_next = mru[c->ws])) c->mru_next->mru_prev = c;
+    c->mru_prev = NULL;
+    mru[c->ws] = c;
+}
+
+static void configure_unlink(Client *c) {
+    if (!c->req_pending) return;
+    Client **pc = &configure_pending;
+    while (*pc != c) pc = &(*pc)->req_next;
+    *pc = c->req_next;
+    c->req_pending = 0;
+}
+
+static void drag_cancel(void) {
+    timer_del(&drag.timer);
+    XUngrabPointer(dpy, CurrentTime);
+    drag.c = NULL;
+}
+
+static void ws_swap(Workspace *w, int i, int j) {
+    Client *t = w->clients[i];
+    w->clients[i] = w->clients[j];
+    w->clients[j] = t;
+    w->clients[i]->idx = i;
+    w->clients[j]->idx = j;
+}
+
+static int master_index(Workspace *w) {
+    for (int i = 0; i < w->n; i++)
+        if (!w->clients[i]->isfloating) return i;
+    return -1;
+}
+
+/* clients of a workspace across all monitors, in monitor then stack order */
+static Client* ws_first_from(Monitor *m, int ws) {
+    for (; m; m = m->next)
+        if (m->ws[ws].n) return m->ws[ws].clients[0];
+    return NULL;
+}
+
+static Client* ws_first(int ws) {
+    return ws_first_from(monitors, ws);
+}
+
+static Client* ws_next(Client *c) {
+    Workspace *w = &c->mon->ws[c->ws];
+    return c->idx + 1 < w->n ? w->clients[c->idx + 1] : ws_first_from(c->mon->next, c->ws);
+}
+
+static Client* ws_prev(Client *c) {
+    if (c->idx > 0) return c->mon->ws[c->ws].clients[c->idx - 1];
+    Client *last = NULL;
+    for (Monitor *m = monitors; m != c->mon; m = m->next)
+        if (m->ws[c->ws].n) last = m->ws[c->ws].clients[m->ws[c->ws].n - 1];
+    return last;
+}
+
+/* most recently focused viewable client on ws other than skip */
+static Client* mru_pick(int ws, Client *skip) {
+    for (Client *c = mru[ws]; c; c = c->mru_next)
+        if (c != skip && can_focus(c)) return c;
+    return NULL;
 }
 
 static void focus(Client *c) {
     if (!can_focus(c)) return;
+    StatMark mark = stat_begin();
     if (focused && focused != c) XSetWindowBorder(dpy, focused->win, border_normal);
-    focused = last_focused[current_ws] = c;
+    focused = c;
+    current_monitor = c->mon;
+    if (mru[c->ws] != c) {
+        mru_unlink(c);
+        mru_push(c);
+    }
     XSetWindowBorder(dpy, c->win, border_focused);
     XRaiseWindow(dpy, c->win);
     XSetInputFocus(dpy, c->win, RevertToPointerRoot, CurrentTime);
+    stat_end(&fn_stats[StatFocus], mark);
+}
+
+static void setborderwidth(Client *c, int bw) {
+    if (c->sbw == bw) {
+        skipped_requests++;
+        return;
+    }
+    c->sbw = bw;
+    XSetWindowBorderWidth(dpy, c->win, bw);
+}
+
+static void mapclient(Client *c) {
+    if (c->ismapped) {
+        skipped_requests++;
+        return;
+    }
+    c->ismapped = 1;
+    XMapWindow(dpy, c->win);
+}
+
+static void unmapclient(Client *c) {
+    if (!c->ismapped) {
+        skipped_requests++;
+        return;
+    }
+    c->ismapped = 0;
+    XUnmapWindow(dpy, c->win);
 }
 
 static void resize(Client *c, int x, int y, int w, int h) {
     c->x = x; c->y = y; c->w = w; c->h = h;
     int bw = c->isfullscreen ? 0 : border_width;
-    XSetWindowBorderWidth(dpy, c->win, bw);
-    XMoveResizeWindow(dpy, c->win, x, y, w - 2 * bw, h - 2 * bw);
+    setborderwidth(c, bw);
+    w -= 2 * bw;
+    h -= 2 * bw;
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+    if (c->sx == x && c->sy == y && c->sw == w && c->sh == h) {
+        skipped_requests++;
+        return;
+    }
+    c->sx = x; c->sy = y; c->sw = w; c->sh = h;
+    XMoveResizeWindow(dpy, c->win, x, y, w, h);
 }
 
 static void arrange_monitor(Monitor *mon) {
-    int x0 = mon->x + global_struts[0] + padding;
-    int y0 = mon->y + global_struts[2] + padding;
-    int usable_w = mon->w - global_struts[0] - global_struts[1] - 2 * padding;
-    int usable_h = mon->h - global_struts[2] - global_struts[3] - 2 * padding;
-
+    Workspace *ws = &mon->ws[current_ws];
     int n = 0;
-    Client *master = NULL;
-    for (Client *c = workspaces[current_ws]; c; c = c->next) {
-        if (!c->isfloating && get_monitor_for_window(c) == mon) {
-            if (!master) master = c;
-            n++;
-        }
-    }
+    for (int i = 0; i < ws->n; i++)
+        if (!ws->clients[i]->isfloating) n++;
     if (!n) return;
+    if (n > layout_cap) {
+        Rect *p = realloc(layout_geom, n * sizeof(Rect));
+        if (!p) return;
+        layout_geom = p;
+        layout_cap = n;
+    }
 
-    if (n == 1) {
-        resize(master, x0, y0, usable_w, usable_h);
-        XMapWindow(dpy, master->win);
-    } else {
-        int mw = (int)(usable_w * master_size);
-        int stack_w = usable_w - mw - padding;
-        resize(master, x0 + usable_w - mw, y0, mw, usable_h);
-        XMapWindow(dpy, master->win);
-
-        int th = usable_h / (n - 1), y = y0, stacked = 0;
-        for (Client *c = workspaces[current_ws]; c; c = c->next) {
-            if (c->isfloating || c == master || get_monitor_for_window(c) != mon) continue;
-            stacked++;
-            int h = (stacked < n - 1) ? th : (usable_h - (y - y0));
-            if (h < min_window_size) h = min_window_size;
-            resize(c, x0, y, stack_w, h);
-            XMapWindow(dpy, c->win);
-            y += h + padding;
-        }
+    StatMark mark = stat_begin();
+    layout_tile((Rect){mon->x, mon->y, mon->w, mon->h}, mon->struts, padding,
+                mon->master_size, min_window_size, n, layout_geom);
+    for (int i = 0, j = 0; i < ws->n; i++) {
+        Client *c = ws->clients[i];
+        if (c->isfloating) continue;
+        resize(c, layout_geom[j].x, layout_geom[j].y, layout_geom[j].w, layout_geom[j].h);
+        mapclient(c);
+        j++;
     }
+    stat_end(&fn_stats[StatArrangeMonitor], mark);
 }
 
-static void arrange(void) {
-    if (!workspaces[current_ws]) return;
-
-    for (Client *c = workspaces[current_ws]; c; c = c->next) {
+static int arrange_fullscreen(void) {
+    for (Client *c = ws_first(current_ws); c; c = ws_next(c)) {
         if (c->isfullscreen) {
-            Monitor *m = get_monitor_for_window(c);
-            XSetWindowBorderWidth(dpy, c->win, 0);
-            resize(c, m->x, m->y, m->w, m->h);
-            XMapWindow(dpy, c->win);
+            resize(c, c->mon->x, c->mon->y, c->mon->w, c->mon->h);
+            mapclient(c);
             XRaiseWindow(dpy, c->win);
-            for (Client *o = workspaces[current_ws]; o; o = o->next) {
+            for (Client *o = ws_first(current_ws); o; o = ws_next(o)) {
                 if (o != c) {
                     o->ishidden = 1;
-                    XUnmapWindow(dpy, o->win);
+                    unmapclient(o);
                 }
             }
-            return;
+            return 1;
         }
     }
+    return 0;
+}
 
-    for (Client *c = workspaces[current_ws]; c; c = c->next) {
-        c->ishidden = 0;
-        XSetWindowBorderWidth(dpy, c->win, border_width);
-        XMapWindow(dpy, c->win);
+static void arrange_now(void) {
+    arrange_pending = 0;
+    arranges_performed++;
+    StatMark mark = stat_begin();
+    if (ws_first(current_ws) && !arrange_fullscreen()) {
+        for (Monitor *m = monitors; m; m = m->next) {
+            if (!m->dirty) continue;
+            Workspace *ws = &m->ws[current_ws];
+            for (int i = 0; i < ws->n; i++) {
+                ws->clients[i]->ishidden = 0;
+                setborderwidth(ws->clients[i], border_width);
+                mapclient(ws->clients[i]);
+            }
+            arrange_monitor(m);
+            for (int i = 0; i < ws->n; i++)
+                if (ws->clients[i]->isfloating) XRaiseWindow(dpy, ws->clients[i]->win);
+        }
+        if (focused) XRaiseWindow(dpy, focused->win);
     }
-
     for (Monitor *m = monitors; m; m = m->next)
-        arrange_monitor(m);
+        m->dirty = 0;
+    stat_end(&fn_stats[StatArrange], mark);
+}
 
-    for (Client *c = workspaces[current_ws]; c; c = c->next)
-        if (c->isfloating) XRaiseWindow(dpy, c->win);
-    if (focused) XRaiseWindow(dpy, focused->win);
+static int ewmh_reserve(void) {
+    if (ewmh_nclients < ewmh_cap) return 1;
+    int cap = ewmh_cap ? ewmh_cap * 2 : 64;
+    Window *p = realloc(ewmh_clients, cap * sizeof(Window));
+    if (!p) return 0;
+    ewmh_clients = p;
+    ewmh_cap = cap;
+    return 1;
 }
 
-static Client* create_client(Window win, int floating) {
-    Client *c = calloc(1, sizeof(Client));
+/* geom is where a floating client placed itself, NULL if unknown */
+static Client* create_client(Window win, int floating, const Rect *geom) {
+    Client *c = pool_alloc(&client_pool);
     if (!c) return NULL;
+    /* a floating client that placed itself on a head belongs to it, so the
+     * clamp in configure_flush does not pull it over to the current one */
+    Monitor *m = current_monitor ? current_monitor : monitors;
+    if (floating && geom) {
+        int cx = geom->x + geom->w / 2, cy = geom->y + geom->h / 2;
+        for (Monitor *h = monitors; h; h = h->next)
+            if (cx >= h->x && cx < h->x + h->w && cy >= h->y && cy < h->y + h->h) m = h;
+    }
+    if (!ewmh_reserve() || !attach(c, m, current_ws, 0)) {
+        pool_free(&client_pool, c);
+        return NULL;
+    }
     c->win = win;
-    c->ws = current_ws;
+    ewmh_clients[ewmh_nclients++] = win;
     c->isfloating = floating;
-    c->next = workspaces[current_ws];
-    workspaces[current_ws] = c;
-
-    if (current_monitor) {
+    hash_client(c);
+
+    c->sw = c->sh = -1;
+    c->sbw = -1;
+    if (floating && geom) {
+        c->x = c->sx = geom->x;
+        c->y = c->sy = geom->y;
+        c->sw = geom->w;
+        c->sh = geom->h;
+        c->w = geom->w + 2 * border_width;
+        c->h = geom->h + 2 * border_width;
+    } else if (current_monitor) {
         c->x = floating ? current_monitor->x + current_monitor->w / 4 : current_monitor->x;
         c->y = floating ? current_monitor->y + current_monitor->h / 4 : current_monitor->y;
         c->w = floating ? current_monitor->w / 2 : current_monitor->w;
         c->h = floating ? current_monitor->h / 2 : current_monitor->h;
     }
-
-    XSetWindowBorderWidth(dpy, c->win, border_width);
+    c->desktop = -1;
+    ewmh_dirty = ewmh_desktops_dirty = 1;
+    mru_push(c);
+    setborderwidth(c, border_width);
     XSetWindowBorder(dpy, c->win, border_normal);
     XSelectInput(dpy, c->win, EnterWindowMask | LeaveWindowMask | FocusChangeMask | StructureNotifyMask);
-    XMapWindow(dpy, c->win);
+    /* nothing lays out floating clients, so a made-up rect must be sent */
+    if (floating && !geom) resize(c, c->x, c->y, c->w, c->h);
+    mapclient(c);
     return c;
 }
 
 static void removeclient(Window win) {
-    for (Client **p = &workspaces[current_ws]; *p; p = &(*p)->next) {
-        if ((*p)->win == win) {
-            Client *c = *p;
-            int was_focused = (focused == c);
-            *p = c->next;
-            XSelectInput(dpy, c->win, NoEventMask);
-            if (last_focused[current_ws] == c) last_focused[current_ws] = NULL;
-            free(c);
-            if (!workspaces[current_ws]) focused = NULL;
-            else if (was_focused) focus(workspaces[current_ws]);
-            arrange();
-            return;
+    Client *c = wintoclient(win);
+    if (!c) return;
+    detach(c);
+    int was_focused = (focused == c), ws = c->ws;
+    Monitor *m = c->isfullscreen ? NULL : c->mon;
+    unhash_client(c);
+    for (int i = 0; i < ewmh_nclients; i++) {
+        if (ewmh_clients[i] == c->win) {
+            memmove(&ewmh_clients[i], &ewmh_clients[i + 1], (--ewmh_nclients - i) * sizeof(Window));
+            break;
         }
     }
+    ewmh_dirty = 1;
+    XSelectInput(dpy, c->win, NoEventMask);
+    if (drag.c == c) drag_cancel();
+    mru_unlink(c);
+    configure_unlink(c);
+    pool_free(&client_pool, c);
+    if (was_focused) focused = NULL;
+    if (ws != current_ws) return;
+    if (was_focused) focus(mru_pick(current_ws, NULL));
+    arrange(m);
+}
+
+static void drag_apply(void) {
+    Client *c = drag.c;
+    int dx = drag.mx - drag.px, dy = drag.my - drag.py, min = 2 * border_width + 1;
+    if (drag.resizing)
+        resize(c, c->x, c->y, drag.w + dx < min ? min : drag.w + dx, drag.h + dy < min ? min : drag.h + dy);
+    else
+        resize(c, drag.x + dx, drag.y + dy, c->w, c->h);
+    drag.last_us = now_us();
+}
+
+static void drag_timeout(void *arg) {
+    (void)arg;
+    if (drag.c) drag_apply();
+}
+
+/* release the pointer; a moved client joins the monitor under its centre */
+static void drag_end(void) {
+    Client *c = drag.c;
+    drag_cancel();
+    Monitor *m = get_monitor_at(c->x + c->w / 2, c->y + c->h / 2);
+    if (m != c->mon && ws_reserve(&m->ws[c->ws])) {
+        arrange(c->mon);
+        detach(c);
+        attach(c, m, c->ws, -1);
+        arrange(m);
+    }
 }
 
 static void buttonpress(XEvent *e) {
-    for (Client *c = workspaces[current_ws]; c; c = c->next)
-        if (c->win == e->xbutton.subwindow) {
-            focus(c);
-            break;
-        }
+    XButtonEvent *ev = &e->xbutton;
+    Client *c = wintoclient(ev->subwindow);
+    if (!c) return;
+    focus(c);
+    if (drag.c || !c->isfloating || c->isfullscreen || CLEANMASK(ev->state) != MOD) return;
+    if (ev->button != Button1 && ev->button != Button3) return;
+    roundtrips++;
+    if (XGrabPointer(dpy, root, False, ButtonReleaseMask | PointerMotionMask, GrabModeAsync,
+                     GrabModeAsync, None, ev->button == Button1 ? cursor_move : cursor_resize,
+                     CurrentTime) != GrabSuccess)
+        return;
+    drag = (Drag){
+        .c = c, .resizing = ev->button == Button3,
+        .px = ev->x_root, .py = ev->y_root, .mx = ev->x_root, .my = ev->y_root,
+        .x = c->x, .y = c->y, .w = c->w, .h = c->h,
+    };
 }
 
-static void configurerequest(XEvent *e) {
-    XConfigureRequestEvent *ev = &e->xconfigurerequest;
-    Client *c = NULL;
+/* a run of queued motion collapses into its newest event, and geometry goes
+ * out at most once per refresh of the client's monitor; the timer sends the
+ * last position. Replays keep every event so they match the recording. */
+static void motionnotify(XEvent *e) {
+    if (!drag.c) return;
+    XEvent nx;
+    while (!replaying && XPending(dpy) && (XPeekEvent(dpy, &nx), nx.type == MotionNotify)) {
+        XNextEvent(dpy, e);
+        last_serial = e->xany.serial;
+        if (trace) trace_record(e);
+    }
+    drag.mx = e->xmotion.x_root;
+    drag.my = e->xmotion.y_root;
+    long wait_us = drag.c->mon->frame_ms * 1000L - (now_us() - drag.last_us);
+    if (wait_us <= 0) {
+        timer_del(&drag.timer);
+        drag_apply();
+    } else if (!drag.timer.pprev) {
+        timer_add(&drag.timer, (wait_us + 999) / 1000, drag_timeout, NULL);
+    }
+}
 
-    for (int i = 0; i < NUM_WS; i++) {
-        for (Client *curr = workspaces[i]; curr; curr = curr->next) {
-            if (curr->win == ev->window) {
-                c = curr;
-                break;
+static void buttonrelease(XEvent *e) {
+    (void)e;
+    if (!drag.c) return;
+    drag_apply();
+    drag_end();
+}
+
+/* tell c where it is, for requests that did not move it */
+static void configure(Client *c) {
+    int bw = c->isfullscreen ? 0 : border_width;
+    XConfigureEvent ce = {
+        .type = ConfigureNotify,
+        .display = dpy,
+        .event = c->win,
+        .window = c->win,
+        .x = c->x,
+        .y = c->y,
+        .width = c->w - 2 * bw,
+        .height = c->h - 2 * bw,
+        .border_width = bw,
+        .above = None,
+        .override_redirect = False
+    };
+    XSendEvent(dpy, c->win, False, StructureNotifyMask, (XEvent *)&ce);
+}
+
+/* apply the last requested geometry of floating clients within their
+ * monitor's free area and answer each client once per batch, with a
+ * synthetic notify only where nothing was moved */
+static void configure_flush(void) {
+    while (configure_pending) {
+        Client *c = configure_pending;
+        configure_pending = c->req_next;
+        c->req_pending = 0;
+        configures_answered++;
+        if (c->isfloating && !c->isfullscreen) {
+            int w = (c->req_mask & CWWidth ? c->req_w + 2 * border_width : c->w);
+            int h = (c->req_mask & CWHeight ? c->req_h + 2 * border_width : c->h);
+            int x = c->req_mask & CWX ? c->req_x : c->x;
+            int y = c->req_mask & CWY ? c->req_y : c->y;
+            clamp_to_monitor(c->mon, &x, &y, &w, &h);
+            /* a real move or resize makes the server send ConfigureNotify */
+            if (x != c->x || y != c->y || w != c->w || h != c->h) {
+                resize(c, x, y, w, h);
+                continue;
             }
         }
-        if (c) break;
+        configure(c);
     }
+}
+
+static void configurerequest(XEvent *e) {
+    XConfigureRequestEvent *ev = &e->xconfigurerequest;
+    Client *c = wintoclient(ev->window);
 
     if (c) {
-        int bw = c->isfullscreen ? 0 : border_width;
-        XConfigureEvent ce = {
-            .type = ConfigureNotify,
-            .display = dpy,
-            .event = c->win,
-            .window = c->win,
-            .x = c->x,
-            .y = c->y,
-            .width = c->w - 2 * bw,
-            .height = c->h - 2 * bw,
-            .border_width = bw,
-            .above = None,
-            .override_redirect = False
-        };
-        XSendEvent(dpy, c->win, False, StructureNotifyMask, (XEvent *)&ce);
+        configures_requested++;
+        if (ev->value_mask & CWX) c->req_x = ev->x;
+        if (ev->value_mask & CWY) c->req_y = ev->y;
+        if (ev->value_mask & CWWidth) c->req_w = ev->width;
+        if (ev->value_mask & CWHeight) c->req_h = ev->height;
+        c->req_mask = c->req_pending ? c->req_mask | ev->value_mask : ev->value_mask;
+        if (!c->req_pending) {
+            c->req_pending = 1;
+            c->req_next = configure_pending;
+            configure_pending = c;
+        }
     } else {
         XWindowChanges wc = {
             .x = ev->x,
@@ -399,96 +1242,215 @@ static void configurerequest(XEvent *e) {
     }
 }
 
-static void maprequest(XEvent *e) {
-    XMapRequestEvent *ev = &e->xmaprequest;
-    XWindowAttributes wa;
-    if (!XGetWindowAttributes(dpy, ev->window, &wa) || wa.override_redirect) return;
-
-    for (int i = 0; i < NUM_WS; i++)
-        for (Client *c = workspaces[i]; c; c = c->next)
-            if (c->win == ev->window) {
-                XMapWindow(dpy, ev->window);
-                return;
-            }
-
-    if (check_window_type(ev->window, "_NET_WM_WINDOW_TYPE_NOTIFICATION") ||
-        check_window_type(ev->window, "_NET_WM_WINDOW_TYPE_SPLASH")) {
-        XMapWindow(dpy, ev->window);
+static void manage(Window win, int unmanaged, const long *struts, int floating, const Rect *geom) {
+    if (unmanaged) {
+        XMapWindow(dpy, win);
         return;
     }
 
-    long struts[4] = {0};
-    if (get_window_struts(ev->window, struts)) {
-        StrutWindow *swin = calloc(1, sizeof(StrutWindow));
+    if (struts) {
+        StrutWindow *swin = pool_alloc(&strut_pool);
         if (swin) {
-            swin->win = ev->window;
-            memcpy(swin->struts, struts, sizeof(struts));
+            swin->win = win;
+            memcpy(swin->struts, struts, sizeof(swin->struts));
             swin->next = strut_windows;
             strut_windows = swin;
-            update_struts();
+            hash_strut(swin);
+            XSelectInput(dpy, win, PropertyChangeMask);
+            struts_changed(NULL, swin->struts);
         }
-        XMapWindow(dpy, ev->window);
-        arrange();
+        XMapWindow(dpy, win);
         return;
     }
 
-    Window trans = None;
-    int floating = (XGetTransientForHint(dpy, ev->window, &trans) && trans != None);
-    Client *c = create_client(ev->window, floating);
+    Client *c = create_client(win, floating, geom);
     if (c) {
         if (floating) {
             XRaiseWindow(dpy, c->win);
             focus(c);
         } else {
             focus(c);
-            arrange();
+            arrange(c->mon);
         }
     }
 }
 
-static void unmapnotify(XEvent *e) {
-    if (e->xunmap.send_event) return;
-    for (StrutWindow *swin = strut_windows; swin; swin = swin->next) {
-        if (swin->win == e->xunmap.window) {
-            remove_strut_window(e->xunmap.window);
-            arrange();
-            return;
-        }
+/* queue every request admission needs without waiting for any reply */
+static void admit_send(Admission *a, Window win) {
+    a->win = win;
+    a->attr = xcb_get_window_attributes(xc, win);
+    a->geom = xcb_get_geometry(xc, win);
+    a->type = xcb_get_property(xc, 0, win, atoms[NetWMWindowType], XCB_ATOM_ATOM, 0, 32);
+    a->strut_partial = xcb_get_property(xc, 0, win, atoms[NetWMStrutPartial], XCB_ATOM_CARDINAL, 0, 12);
+    a->strut = xcb_get_property(xc, 0, win, atoms[NetWMStrut], XCB_ATOM_CARDINAL, 0, 4);
+    a->transient = xcb_get_property(xc, 0, win, XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, 0, 1);
+}
+
+static void admit_finish(Admission *a, int viewable_only) {
+    xcb_get_window_attributes_reply_t *wa = xcb_get_window_attributes_reply(xc, a->attr, NULL);
+    xcb_get_geometry_reply_t *g = xcb_get_geometry_reply(xc, a->geom, NULL);
+    xcb_get_property_reply_t *type = xcb_get_property_reply(xc, a->type, NULL);
+    xcb_get_property_reply_t *partial = xcb_get_property_reply(xc, a->strut_partial, NULL);
+    xcb_get_property_reply_t *strut = xcb_get_property_reply(xc, a->strut, NULL);
+    xcb_get_property_reply_t *trans = xcb_get_property_reply(xc, a->transient, NULL);
+
+    if (wa && !wa->override_redirect && (!viewable_only || wa->map_state == XCB_MAP_STATE_VIEWABLE)) {
+        Atom unmanaged[] = {atoms[NetWMWindowTypeNotification], atoms[NetWMWindowTypeSplash]};
+        long struts[12] = {0};
+        int has_struts = reply_struts(partial, strut, struts);
+        int floating = trans && trans->type == XCB_ATOM_WINDOW && trans->format == 32 &&
+                       trans->value_len > 0 && *(uint32_t *)xcb_get_property_value(trans) != None;
+        Rect geom = g ? (Rect){g->x, g->y, g->width, g->height} : (Rect){0};
+        manage(a->win, reply_has_type(type, unmanaged, LENGTH(unmanaged)),
+               has_struts ? struts : NULL, floating, g ? &geom : NULL);
     }
-    for (int i = 0; i < NUM_WS; i++) {
-        for (Client *c = workspaces[i]; c; c = c->next) {
-            if (c->win == e->xunmap.window) {
-                if (!c->ishidden && i == current_ws) removeclient(e->xunmap.window);
-                return;
-            }
-        }
+    free(wa);
+    free(g);
+    free(type);
+    free(partial);
+    free(strut);
+    free(trans);
+}
+
+static void maprequest(XEvent *e) {
+    XMapRequestEvent *ev = &e->xmaprequest;
+    Client *c = wintoclient(ev->window);
+    if (c) c->ismapped = 1;
+    if (c || wintostrut(ev->window)) {
+        XMapWindow(dpy, ev->window);
+        return;
     }
+
+    StatMark mark = stat_begin();
+    Admission a;
+    admit_send(&a, ev->window);
+    admit_finish(&a, 0);
+    roundtrips++;
+    stat_end(&fn_stats[StatMaprequest], mark);
+}
+
+static void mapnotify(XEvent *e) {
+    Client *c = wintoclient(e->xmap.window);
+    if (c) c->ismapped = 1;
+}
+
+static void unmapnotify(XEvent *e) {
+    if (e->xunmap.send_event) return;
+    if (remove_strut_window(e->xunmap.window)) return;
+    Client *c = wintoclient(e->xunmap.window);
+    if (!c) return;
+    c->ismapped = 0;
+    if (!c->ishidden && c->ws == current_ws) removeclient(e->xunmap.window);
 }
 
 static void destroynotify(XEvent *e) {
-    remove_strut_window(e->xdestroywindow.window);
+    if (remove_strut_window(e->xdestroywindow.window)) return;
     removeclient(e->xdestroywindow.window);
 }
 
+/* docks move or resize their reservation at runtime */
+static void propertynotify(XEvent *e) {
+    XPropertyEvent *ev = &e->xproperty;
+    if (ev->atom != atoms[NetWMStrutPartial] && ev->atom != atoms[NetWMStrut]) return;
+    StrutWindow *s = wintostrut(ev->window);
+    if (!s) return;
+    xcb_get_property_cookie_t pc = xcb_get_property(xc, 0, s->win, atoms[NetWMStrutPartial], XCB_ATOM_CARDINAL, 0, 12);
+    xcb_get_property_cookie_t sc = xcb_get_property(xc, 0, s->win, atoms[NetWMStrut], XCB_ATOM_CARDINAL, 0, 4);
+    xcb_get_property_reply_t *partial = xcb_get_property_reply(xc, pc, NULL);
+    xcb_get_property_reply_t *strut = xcb_get_property_reply(xc, sc, NULL);
+    roundtrips++;
+    long old[12];
+    memcpy(old, s->struts, sizeof(old));
+    if (!reply_struts(partial, strut, s->struts)) memset(s->struts, 0, sizeof(s->struts));
+    free(partial);
+    free(strut);
+    if (memcmp(old, s->struts, sizeof(old))) struts_changed(old, s->struts);
+}
+
 static void enternotify(XEvent *e) {
     if (e->xcrossing.mode != NotifyNormal || e->xcrossing.detail == NotifyInferior) return;
-    for (Client *c = workspaces[current_ws]; c; c = c->next) {
-        if (c->win == e->xcrossing.window) {
-            focus(c);
-            break;
+    if (e->xcrossing.serial >= enter_from && e->xcrossing.serial < enter_to) {
+        enters_ignored++;
+        return;
+    }
+    Client *c = wintoclient(e->xcrossing.window);
+    if (c) focus(c);
+}
+
+static void update_numlockmask(void) {
+    XModifierKeymap *modmap = XGetModifierMapping(dpy);
+    roundtrips++;
+    KeyCode numlock = XKeysymToKeycode(dpy, XK_Num_Lock);
+    numlockmask = 0;
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < modmap->max_keypermod; j++)
+            if (numlock && modmap->modifiermap[i * modmap->max_keypermod + j] == numlock)
+                numlockmask = (1 << i);
+    XFreeModifiermap(modmap);
+}
+
+static void keytab_insert(unsigned int code, const Key *k) {
+    for (unsigned int i = 0, h = KEYHASH(code); i < KEYTAB_SIZE; i++, h = (h + 1) & (KEYTAB_SIZE - 1)) {
+        if (!keytab[h].key || keytab[h].code == code) {
+            keytab[h].code = code;
+            keytab[h].key = k;
+            return;
         }
     }
 }
 
-static void keypress(XEvent *e) {
-    KeySym keysym = XLookupKeysym(&e->xkey, 0);
-    unsigned int state = CLEANMASK(e->xkey.state);
-    for (size_t i = 0; i < LENGTH(keys); i++) {
-        if (keysym == keys[i].keysym && state == keys[i].mod && keys[i].func) {
-            keys[i].func(&keys[i].arg);
-            break;
+static const Key* keytab_lookup(unsigned int code) {
+    for (unsigned int i = 0, h = KEYHASH(code); i < KEYTAB_SIZE && keytab[h].key; i++, h = (h + 1) & (KEYTAB_SIZE - 1))
+        if (keytab[h].code == code) return keytab[h].key;
+    return NULL;
+}
+
+/* rebuild the keycode table and grabs from the current keyboard mapping */
+static void grabkeys(void) {
+    int min, max, per;
+    update_numlockmask();
+    unsigned int locks[] = {0, LockMask, numlockmask, numlockmask | LockMask};
+    memset(keytab, 0, sizeof(keytab));
+    XUngrabKey(dpy, AnyKey, AnyModifier, root);
+    XDisplayKeycodes(dpy, &min, &max);
+    KeySym *syms = XGetKeyboardMapping(dpy, min, max - min + 1, &per);
+    roundtrips++;
+    if (!syms) return;
+    for (int code = min; code <= max; code++) {
+        KeySym sym = syms[(code - min) * per];
+        for (size_t i = 0; i < LENGTH(keys); i++) {
+            if (keys[i].keysym != sym || !keys[i].func) continue;
+            keytab_insert(code << 8 | CLEANMASK(keys[i].mod), &keys[i]);
+            for (size_t j = 0; j < LENGTH(locks); j++)
+                XGrabKey(dpy, code, keys[i].mod | locks[j], root, True, GrabModeAsync, GrabModeAsync);
         }
     }
+    XFree(syms);
+}
+
+static void grabbuttons(void) {
+    unsigned int locks[] = {0, LockMask, numlockmask, numlockmask | LockMask};
+    XUngrabButton(dpy, AnyButton, AnyModifier, root);
+    for (size_t j = 0; j < LENGTH(locks); j++) {
+        XGrabButton(dpy, Button1, MOD | locks[j], root, False, ButtonPressMask,
+                    GrabModeAsync, GrabModeAsync, None, None);
+        XGrabButton(dpy, Button3, MOD | locks[j], root, False, ButtonPressMask,
+                    GrabModeAsync, GrabModeAsync, None, None);
+    }
+}
+
+static void keypress(XEvent *e) {
+    const Key *k = keytab_lookup(e->xkey.keycode << 8 | CLEANMASK(e->xkey.state));
+    if (k) k->func(&k->arg);
+}
+
+static void mappingnotify(XEvent *e) {
+    XMappingEvent *ev = &e->xmapping;
+    XRefreshKeyboardMapping(ev);
+    if (ev->request == MappingKeyboard || ev->request == MappingModifier) {
+        grabkeys();
+        grabbuttons();
+    }
 }
 
 static void screenchange(XEvent *e) {
@@ -496,30 +1458,84 @@ static void screenchange(XEvent *e) {
     sw = DisplayWidth(dpy, screen);
     sh = DisplayHeight(dpy, screen);
     update_monitors();
-    arrange();
+}
+
+static void ewmh_setup(void) {
+    Atom supported[] = {
+        atoms[NetSupported], atoms[NetSupportingWMCheck], atoms[NetWMName],
+        atoms[NetClientList], atoms[NetActiveWindow], atoms[NetNumberOfDesktops],
+        atoms[NetCurrentDesktop], atoms[NetWMDesktop], atoms[NetWMWindowType],
+        atoms[NetWMStrut], atoms[NetWMStrutPartial],
+    };
+    long ndesktops = NUM_WS;
+    wmcheck = XCreateSimpleWindow(dpy, root, 0, 0, 1, 1, 0, 0, 0);
+    XChangeProperty(dpy, wmcheck, atoms[NetSupportingWMCheck], XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *)&wmcheck, 1);
+    XChangeProperty(dpy, wmcheck, atoms[NetWMName], atoms[UTF8String], 8,
+                    PropModeReplace, (unsigned char *)"eowm", 4);
+    XChangeProperty(dpy, root, atoms[NetSupportingWMCheck], XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *)&wmcheck, 1);
+    XChangeProperty(dpy, root, atoms[NetSupported], XA_ATOM, 32,
+                    PropModeReplace, (unsigned char *)supported, LENGTH(supported));
+    XChangeProperty(dpy, root, atoms[NetNumberOfDesktops], XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char *)&ndesktops, 1);
+    XDeleteProperty(dpy, root, atoms[NetClientList]);
+}
+
+/* once per event batch: rewrite only the EWMH properties whose value changed */
+static void ewmh_flush(void) {
+    if (ewmh_desktop != current_ws) {
+        long d = ewmh_desktop = current_ws;
+        XChangeProperty(dpy, root, atoms[NetCurrentDesktop], XA_CARDINAL, 32,
+                        PropModeReplace, (unsigned char *)&d, 1);
+    }
+    Window active = focused ? focused->win : None;
+    if (ewmh_active != active) {
+        ewmh_active = active;
+        XChangeProperty(dpy, root, atoms[NetActiveWindow], XA_WINDOW, 32,
+                        PropModeReplace, (unsigned char *)&active, 1);
+    }
+    if (ewmh_desktops_dirty) {
+        ewmh_desktops_dirty = 0;
+        for (int i = 0; i < ewmh_nclients; i++) {
+            Client *c = wintoclient(ewmh_clients[i]);
+            if (c && c->desktop != c->ws) {
+                long d = c->desktop = c->ws;
+                XChangeProperty(dpy, c->win, atoms[NetWMDesktop], XA_CARDINAL, 32,
+                                PropModeReplace, (unsigned char *)&d, 1);
+            }
+        }
+    }
+    /* only adding or removing a client changes the mapping-order list */
+    if (!ewmh_dirty) return;
+    ewmh_dirty = 0;
+    XChangeProperty(dpy, root, atoms[NetClientList], XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *)ewmh_clients, ewmh_nclients);
 }
 
 static void scan(void) {
     unsigned int num;
     Window d1, d2, *wins = NULL;
-    XWindowAttributes wa;
-    if (XQueryTree(dpy, root, &d1, &d2, &wins, &num)) {
-        for (unsigned int i = 0; i < num; i++) {
-            if (XGetWindowAttributes(dpy, wins[i], &wa) && !wa.override_redirect && wa.map_state == IsViewable) {
-                XEvent e = {.type = MapRequest, .xmaprequest.window = wins[i]};
-                maprequest(&e);
-            }
-        }
-        if (wins) XFree(wins);
+    if (!XQueryTree(dpy, root, &d1, &d2, &wins, &num)) return;
+    roundtrips += 2;
+    Admission *a = num ? malloc(num * sizeof(Admission)) : NULL;
+    if (a) {
+        for (unsigned int i = 0; i < num; i++)
+            admit_send(&a[i], wins[i]);
+        for (unsigned int i = 0; i < num; i++)
+            admit_finish(&a[i], 1);
+        free(a);
     }
+    if (wins) XFree(wins);
 }
 
 void focus_monitor(const Arg *arg) {
     if (!monitors || monitor_count <= 1) return;
     current_monitor = cycle_monitor(current_monitor, arg->i);
-    for (Client *c = workspaces[current_ws]; c; c = c->next) {
-        if (!c->ishidden && !c->isfloating && get_monitor_for_window(c) == current_monitor) {
-            focus(c);
+    Workspace *ws = &current_monitor->ws[current_ws];
+    for (int i = 0; i < ws->n; i++) {
+        if (!ws->clients[i]->ishidden && !ws->clients[i]->isfloating) {
+            focus(ws->clients[i]);
             break;
         }
     }
@@ -529,11 +1545,13 @@ void focus_monitor(const Arg *arg) {
 
 void movewin_to_monitor(const Arg *arg) {
     if (!focused || !monitors || monitor_count <= 1 || focused->isfloating) return;
-    Monitor *target = cycle_monitor(get_monitor_for_window(focused), arg->i);
-    if (!target || target == get_monitor_for_window(focused)) return;
-    focused->x = target->x + padding;
-    focused->y = target->y + padding;
-    arrange();
+    Monitor *target = cycle_monitor(focused->mon, arg->i);
+    if (!target || target == focused->mon || !ws_reserve(&target->ws[current_ws])) return;
+    arrange(focused->mon);
+    detach(focused);
+    attach(focused, target, current_ws, 0);
+    arrange(target);
+    arrange_now();
     focus(focused);
     XWarpPointer(dpy, None, root, 0, 0, 0, 0, focused->x + focused->w / 2, focused->y + focused->h / 2);
     XFlush(dpy);
@@ -541,84 +1559,85 @@ void movewin_to_monitor(const Arg *arg) {
 
 void killclient(const Arg *arg) {
     (void)arg;
-    if (focused) XKillClient(dpy, focused->win);
+    if (!focused) return;
+    Atom *protos;
+    int n, supported = 0;
+    roundtrips++;
+    if (XGetWMProtocols(dpy, focused->win, &protos, &n)) {
+        while (!supported && n--) supported = (protos[n] == atoms[WMDelete]);
+        XFree(protos);
+    }
+    if (!supported) {
+        XKillClient(dpy, focused->win);
+        return;
+    }
+    XEvent ev = {.type = ClientMessage};
+    ev.xclient.window = focused->win;
+    ev.xclient.message_type = atoms[WMProtocols];
+    ev.xclient.format = 32;
+    ev.xclient.data.l[0] = atoms[WMDelete];
+    ev.xclient.data.l[1] = CurrentTime;
+    XSendEvent(dpy, focused->win, False, NoEventMask, &ev);
 }
 
 void togglemaster(const Arg *arg) {
     (void)arg;
-    if (!focused || !workspaces[current_ws] || focused == workspaces[current_ws]) return;
-    for (Client **p = &workspaces[current_ws]; *p; p = &(*p)->next) {
-        if (*p == focused) {
-            *p = focused->next;
-            focused->next = workspaces[current_ws];
-            workspaces[current_ws] = focused;
-            arrange();
-            return;
-        }
-    }
+    if (!focused || focused->isfloating) return;
+    Workspace *ws = &focused->mon->ws[focused->ws];
+    int m = master_index(ws);
+    if (m == focused->idx) return;
+    ws_swap(ws, m, focused->idx);
+    arrange(focused->mon);
 }
 
 void incmaster(const Arg *arg) {
     (void)arg;
-    master_size = (master_size + 0.05 > 0.9) ? 0.9 : master_size + 0.05;
-    arrange();
+    Monitor *m = current_monitor;
+    if (!m) return;
+    m->master_size = (m->master_size + 0.05 > 0.9) ? 0.9 : m->master_size + 0.05;
+    arrange(m);
 }
 
 void decmaster(const Arg *arg) {
     (void)arg;
-    master_size = (master_size - 0.05 < 0.1) ? 0.1 : master_size - 0.05;
-    arrange();
+    Monitor *m = current_monitor;
+    if (!m) return;
+    m->master_size = (m->master_size - 0.05 < 0.1) ? 0.1 : m->master_size - 0.05;
+    arrange(m);
 }
 
 void nextwin(const Arg *arg) {
     (void)arg;
-    if (!focused || !workspaces[current_ws]) return;
-    Client *c = focused->next;
-    while (c && !can_focus(c)) c = c->next;
-    focus(c ? c : workspaces[current_ws]);
+    if (!focused) return;
+    for (Client *c = ws_next(focused); c; c = ws_next(c)) {
+        if (can_focus(c)) {
+            focus(c);
+            return;
+        }
+    }
+    focus(ws_first(current_ws));
 }
 
 void prevwin(const Arg *arg) {
     (void)arg;
-    if (!focused || !workspaces[current_ws]) return;
-    Client *prev = NULL, *last = workspaces[current_ws];
-    for (Client *c = workspaces[current_ws]; c; c = c->next) {
-        if (c->next == focused && can_focus(c)) prev = c;
-        if (can_focus(c)) last = c;
+    if (!focused) return;
+    Client *p = ws_prev(focused), *last = NULL;
+    if (p && can_focus(p)) {
+        focus(p);
+        return;
     }
-    focus(prev ? prev : last);
+    for (Client *c = ws_first(current_ws); c; c = ws_next(c))
+        if (can_focus(c)) last = c;
+    if (last) focus(last);
 }
 
 void movewin(const Arg *arg) {
-    if (!focused || !workspaces[current_ws] || focused == workspaces[current_ws]) return;
-    int count = 0, idx = -1;
-    for (Client *c = workspaces[current_ws]->next; c; c = c->next) {
-        if (c == focused) idx = count;
-        count++;
-    }
-    int target_idx = idx + arg->i;
-    if (idx < 0 || target_idx < 0 || target_idx >= count) return;
-
-    Client **arr = malloc(count * sizeof(Client *));
-    if (!arr) return;
-    Client *c = workspaces[current_ws]->next;
-    for (int i = 0; i < count; i++) {
-        arr[i] = c;
-        c = c->next;
-    }
-
-    Client *tmp = arr[idx];
-    arr[idx] = arr[target_idx];
-    arr[target_idx] = tmp;
-
-    c = workspaces[current_ws];
-    for (int i = 0; i < count; i++) {
-        c->next = arr[i];
-        c = c->next;
-    }
-    c->next = NULL;
-    free(arr);
-    arrange();
+    if (!focused || focused->isfloating) return;
+    Workspace *ws = &focused->mon->ws[focused->ws];
+    int m = master_index(ws), target = focused->idx + arg->i;
+    if (focused->idx == m || target <= m || target >= ws->n) return;
+    ws_swap(ws, focused->idx, target);
+    arrange(focused->mon);
 }
 
 void switchws(const Arg *arg) {
@@ -627,43 +1646,39 @@ void switchws(const Arg *arg) {
     int old = current_ws;
     current_ws = ws;
 
-    for (Client *c = workspaces[old]; c; c = c->next) {
+    for (Client *c = ws_first(old); c; c = ws_next(c)) {
         c->ishidden = 1;
-        XUnmapWindow(dpy, c->win);
+        unmapclient(c);
     }
-    for (Client *c = workspaces[current_ws]; c; c = c->next) {
+    for (Client *c = ws_first(current_ws); c; c = ws_next(c)) {
         c->ishidden = 0;
-        XMapWindow(dpy, c->win);
+        mapclient(c);
         XSetWindowBorder(dpy, c->win, border_normal);
     }
 
-    focused = last_focused[current_ws];
-    if (!can_focus(focused)) focused = workspaces[current_ws];
+    focused = mru_pick(current_ws, NULL);
     if (focused) focus(focused);
-    arrange();
+    arrange(NULL);
 }
 
 void movewin_to_ws(const Arg *arg) {
     int ws = arg->i;
     if (!focused || ws < 0 || ws >= NUM_WS || ws == current_ws) return;
     Client *m = focused;
-
-    for (Client **p = &workspaces[current_ws]; *p; p = &(*p)->next) {
-        if (*p == m) {
-            *p = m->next;
-            break;
-        }
-    }
-
-    m->ws = ws;
-    m->next = workspaces[ws];
+    if (!ws_reserve(&m->mon->ws[ws])) return;
+
+    detach(m);
+    mru_unlink(m);
+    attach(m, m->mon, ws, 0);
+    mru_push(m);
+    ewmh_desktops_dirty = 1;
+    /* a fullscreen client had hidden the other heads too */
+    arrange(m->isfullscreen ? NULL : m->mon);
     m->ishidden = m->isfullscreen = 0;
-    workspaces[ws] = m;
-    XUnmapWindow(dpy, m->win);
+    unmapclient(m);
 
-    focused = workspaces[current_ws];
+    focused = mru_pick(current_ws, NULL);
     if (focused) focus(focused);
-    arrange();
 }
 
 void fullscreen(const Arg *arg) {
@@ -671,98 +1686,558 @@ void fullscreen(const Arg *arg) {
     if (!focused) return;
     focused->isfullscreen = !focused->isfullscreen;
     if (!focused->isfullscreen) {
-        XSetWindowBorderWidth(dpy, focused->win, border_width);
+        setborderwidth(focused, border_width);
         XSetWindowBorder(dpy, focused->win, border_focused);
-        for (Client *c = workspaces[current_ws]; c; c = c->next) {
+        for (Client *c = ws_first(current_ws); c; c = ws_next(c)) {
             c->ishidden = 0;
-            XMapWindow(dpy, c->win);
+            mapclient(c);
         }
         focus(focused);
     }
-    arrange();
+    arrange(NULL);
+}
+
+void focuslast(const Arg *arg) {
+    (void)arg;
+    focus(mru_pick(current_ws, focused));
 }
 
 void quit(const Arg *arg) {
     (void)arg;
-    for (int i = 0; i < NUM_WS; i++) {
-        while (workspaces[i]) {
-            Client *tmp = workspaces[i]->next;
-            free(workspaces[i]);
-            workspaces[i] = tmp;
+#ifdef DEBUG
+    dump_stats();
+#endif
+    for (Monitor *m = monitors; m; m = m->next)
+        for (int i = 0; i < NUM_WS; i++)
+            free(m->ws[i].clients);
+    memset(mru, 0, sizeof(mru));
+    memset(client_hash, 0, sizeof(client_hash));
+    memset(strut_hash, 0, sizeof(strut_hash));
+    strut_windows = NULL;
+    monitors = NULL;
+    if (ipc_fd >= 0) unlink(ipc_addr.sun_path);
+    XDeleteProperty(dpy, root, atoms[NetClientList]);
+    XDeleteProperty(dpy, root, atoms[NetActiveWindow]);
+    XDeleteProperty(dpy, root, atoms[NetSupported]);
+    XDestroyWindow(dpy, wmcheck);
+    free(ewmh_clients);
+    free(layout_geom);
+    pool_destroy(&client_pool);
+    pool_destroy(&strut_pool);
+    pool_destroy(&monitor_pool);
+    for (int i = 0; i < nspawn_cmds; i++)
+        free(spawn_cmds[i].buf);
+    XCloseDisplay(dpy);
+    exit(0);
+}
+
+/* split cmd into argv in buf; 0 if it uses anything only a shell understands */
+static int split_cmd(const char *cmd, char *buf, char **argv) {
+    int argc = 0;
+    if (strpbrk(cmd, "\"'\\$`|&;<>(){}[]*?~#=!\n")) return 0;
+    strcpy(buf, cmd);
+    for (char *tok = strtok(buf, " \t"); tok; tok = strtok(NULL, " \t")) {
+        if (argc == SPAWN_MAXARGS) return 0;
+        argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+    return argc > 0;
+}
+
+static void prepare_spawn(void) {
+    for (size_t i = 0; i < LENGTH(keys); i++) {
+        if (keys[i].func != spawn || !keys[i].arg.cmd) continue;
+        SpawnCmd *sc = &spawn_cmds[nspawn_cmds++];
+        sc->cmd = keys[i].arg.cmd;
+        if (!(sc->buf = malloc(strlen(sc->cmd) + 1)) || !split_cmd(sc->cmd, sc->buf, sc->argv))
+            sc->argv[0] = NULL;
+    }
+}
+
+/* posix_spawn shares our address space until exec instead of copying it */
+static void launch(char *const argv[]) {
+    posix_spawnattr_t attr;
+    pid_t pid;
+    if (replaying) return;
+    short flags = POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_SETSID
+    flags |= POSIX_SPAWN_SETSID;
+#endif
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &orig_sigmask);
+    posix_spawnattr_setflags(&attr, flags);
+    if (posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ))
+        fprintf(stderr, "eowm: cannot spawn %s\n", argv[0]);
+    posix_spawnattr_destroy(&attr);
+}
+
+void spawn(const Arg *arg) {
+    char *sh[] = {"/bin/sh", "-c", (char *)arg->cmd, NULL};
+    for (int i = 0; i < nspawn_cmds; i++) {
+        if (spawn_cmds[i].cmd == arg->cmd) {
+            launch(spawn_cmds[i].argv[0] ? spawn_cmds[i].argv : sh);
+            return;
         }
     }
-    while (strut_windows) {
-        StrutWindow *tmp = strut_windows->next;
-        free(strut_windows);
-        strut_windows = tmp;
+    /* not from keys[], e.g. sent over IPC */
+    char buf[IPC_BUFSIZE], *argv[SPAWN_MAXARGS + 1];
+    launch(strlen(arg->cmd) < sizeof(buf) && split_cmd(arg->cmd, buf, argv) ? argv : sh);
+}
+
+static const Command commands[] = {
+    {"switchws",           switchws,           1},
+    {"movewin_to_ws",      movewin_to_ws,      1},
+    {"focus_monitor",      focus_monitor,      1},
+    {"movewin_to_monitor", movewin_to_monitor, 1},
+    {"movewin",            movewin,            1},
+    {"nextwin",            nextwin,            0},
+    {"prevwin",            prevwin,            0},
+    {"incmaster",          incmaster,          0},
+    {"decmaster",          decmaster,          0},
+    {"togglemaster",       togglemaster,       0},
+    {"fullscreen",         fullscreen,         0},
+    {"focuslast",          focuslast,          0},
+    {"killclient",         killclient,         0},
+    {"spawn",              spawn,              2},
+    {"quit",               quit,               0},
+};
+
+static void ipc_setup(void) {
+    const char *path = getenv("EOWM_SOCKET"), *dir = getenv("XDG_RUNTIME_DIR");
+    for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+        ipc_clients[i].fd = -1;
+    ipc_addr.sun_family = AF_UNIX;
+    if (path) snprintf(ipc_addr.sun_path, sizeof(ipc_addr.sun_path), "%s", path);
+    else snprintf(ipc_addr.sun_path, sizeof(ipc_addr.sun_path), "%s/eowm%s.sock", dir ? dir : "/tmp", getenv("DISPLAY"));
+    if ((ipc_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) return;
+
+    /* the socket runs commands: only replace our own stale socket, never a
+     * live one or anything else, and keep it private to this user */
+    struct stat st;
+    if (!lstat(ipc_addr.sun_path, &st)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), live = 1;
+        if (S_ISSOCK(st.st_mode) && st.st_uid == getuid() && probe >= 0)
+            live = !connect(probe, (struct sockaddr *)&ipc_addr, sizeof(ipc_addr)) || errno != ECONNREFUSED;
+        if (probe >= 0) close(probe);
+        if (live || unlink(ipc_addr.sun_path) < 0) goto fail;
     }
-    while (monitors) {
-        Monitor *tmp = monitors->next;
-        free(monitors);
-        monitors = tmp;
+    mode_t mask = umask(077);
+    int ok = bind(ipc_fd, (struct sockaddr *)&ipc_addr, sizeof(ipc_addr)) == 0;
+    umask(mask);
+    if (ok && listen(ipc_fd, 8) == 0) return;
+fail:
+    fprintf(stderr, "eowm: cannot listen on %s\n", ipc_addr.sun_path);
+    close(ipc_fd);
+    ipc_fd = -1;
+}
+
+static void ipc_drop(IpcClient *cl) {
+    close(cl->fd);
+    cl->fd = -1;
+    timer_del(&cl->timeout);
+}
+
+/* idle clients would pin a slot forever */
+static void ipc_timeout(void *arg) {
+    ipc_drop(arg);
+}
+
+/* a client that does not read its replies would get them with a hole */
+static void ipc_flush(IpcClient *cl) {
+    if (ipc_outlen && cl->fd >= 0 && send(cl->fd, ipc_out, ipc_outlen, MSG_DONTWAIT | MSG_NOSIGNAL) != ipc_outlen)
+        ipc_drop(cl);
+    ipc_outlen = 0;
+}
+
+/* replies go out in IPC_BUFSIZE chunks, so any number of lines fits; a single
+ * line longer than that is replaced by an error rather than cut */
+static void ipc_printf(IpcClient *cl, const char *fmt, ...) {
+    va_list ap;
+    for (int retry = 0; cl->fd >= 0; retry = 1) {
+        va_start(ap, fmt);
+        int n = vsnprintf(ipc_out + ipc_outlen, sizeof(ipc_out) - ipc_outlen, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && ipc_outlen + n < (int)sizeof(ipc_out)) {
+            ipc_outlen += n;
+            return;
+        }
+        if (retry || !ipc_outlen) {
+            ipc_outlen += snprintf(ipc_out + ipc_outlen, sizeof(ipc_out) - ipc_outlen, "error: reply truncated\n");
+            return;
+        }
+        ipc_flush(cl);
     }
-    XCloseDisplay(dpy);
-    exit(0);
 }
 
-void spawn(const Arg *arg) {
-    if (fork() == 0) {
-        if (dpy) close(ConnectionNumber(dpy));
-        setsid();
-        execl("/bin/sh", "sh", "-c", arg->cmd, (char *)NULL);
-        exit(1);
+static int ipc_query(const char *q, IpcClient *cl) {
+    if (!strcmp(q, "get_ws")) ipc_printf(cl, "%d\n", current_ws);
+    else if (!strcmp(q, "get_focused")) ipc_printf(cl, "0x%lx\n", focused ? focused->win : 0);
+    else if (!strcmp(q, "get_master_size")) ipc_printf(cl, "%.2f\n", current_monitor ? current_monitor->master_size : default_master_size);
+    else if (!strcmp(q, "get_clients")) {
+        for (int i = 0; i < NUM_WS; i++)
+            for (Client *c = ws_first(i); c; c = ws_next(c))
+                ipc_printf(cl, "0x%lx %d %d %d %d %d %d %d\n", c->win, c->ws,
+                           c->isfloating, c->isfullscreen, c->x, c->y, c->w, c->h);
+    } else if (!strcmp(q, "get_monitors")) {
+        for (Monitor *m = monitors; m; m = m->next)
+            ipc_printf(cl, "%d %d %d %d %d%s\n", m->num, m->x, m->y, m->w, m->h,
+                       m == current_monitor ? " *" : "");
+    } else {
+        return 0;
     }
+    return 1;
 }
 
-int main(int argc, char *argv[]) {
-    XEvent ev;
-    void (*handlers[LASTEvent])(XEvent *) = {
-        [ButtonPress] = buttonpress,
-        [ConfigureRequest] = configurerequest,
-        [MapRequest] = maprequest,
-        [UnmapNotify] = unmapnotify,
-        [DestroyNotify] = destroynotify,
-        [EnterNotify] = enternotify,
-        [KeyPress] = keypress,
-        [RRScreenChangeNotify + RRNotify] = screenchange
+/* run one command line, replies go to cl; the arrange it causes is deferred */
+static void ipc_command(char *line, IpcClient *cl) {
+    char *name = line + strspn(line, " \t"), *arg = name + strcspn(name, " \t");
+    if (*arg) *arg++ = '\0';
+    arg += strspn(arg, " \t");
+    if (!*name || ipc_query(name, cl)) return;
+    for (size_t i = 0; i < LENGTH(commands); i++) {
+        if (strcmp(name, commands[i].name)) continue;
+        Arg a = {0};
+        const char *err = NULL;
+        if (commands[i].argtype == 1) {
+            char *end;
+            a.i = (int)strtol(arg, &end, 10);
+            if (end == arg) err = "needs a number";
+        } else if (commands[i].argtype == 2) {
+            if (!*arg) err = "needs an argument";
+            a.cmd = arg;
+        }
+        if (err) {
+            ipc_printf(cl, "error: %s %s\n", name, err);
+        } else {
+            commands[i].func(&a);
+            ipc_printf(cl, "ok\n");
+        }
+        return;
+    }
+    ipc_printf(cl, "error: unknown command %s\n", name);
+}
+
+static void ipc_accept(void) {
+    int fd;
+    while ((fd = accept(ipc_fd, NULL, NULL)) >= 0) {
+        IpcClient *cl = NULL;
+        for (int i = 0; i < IPC_MAX_CLIENTS && !cl; i++)
+            if (ipc_clients[i].fd < 0) cl = &ipc_clients[i];
+        if (!cl) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        cl->fd = fd;
+        cl->len = 0;
+        timer_add(&cl->timeout, IPC_TIMEOUT_MS, ipc_timeout, cl);
+    }
+}
+
+/* commands are newline or ';' separated, everything in one read is one batch */
+static void ipc_read(IpcClient *cl) {
+    ssize_t n = read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - 1 - cl->len);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) ipc_drop(cl);
+        return;
+    }
+    timer_add(&cl->timeout, IPC_TIMEOUT_MS, ipc_timeout, cl);
+    cl->len += n;
+    cl->buf[cl->len] = '\0';
+
+    char *start = cl->buf, *end;
+    while (cl->fd >= 0 && (end = strpbrk(start, "\n;"))) {
+        *end = '\0';
+        ipc_command(start, cl);
+        start = end + 1;
+    }
+    ipc_flush(cl);
+    if (cl->fd < 0) return;
+    cl->len -= start - cl->buf;
+    memmove(cl->buf, start, cl->len);
+    if (cl->len == sizeof(cl->buf) - 1) cl->len = 0;
+}
+
+static void setup_signals(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, &orig_sigmask);
+    if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) die("eowm: signalfd failed");
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) die("eowm: timerfd failed");
+}
+
+static void handle_signals(void) {
+    struct signalfd_siginfo si;
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+        case SIGCHLD:
+            while (waitpid(-1, NULL, WNOHANG) > 0);
+            break;
+        case SIGUSR1:
+            dump_stats();
+            break;
+        case SIGTERM:
+        case SIGINT:
+            quit(NULL);
+        }
+    }
+}
+
+/* block until X, a signal, a timer or an IPC client has something for us */
+static void wait_input(void) {
+    enum { PollX, PollSignal, PollTimer, PollIpc, PollClients };
+    struct pollfd pfd[PollClients + IPC_MAX_CLIENTS] = {
+        [PollX] = {.fd = ConnectionNumber(dpy), .events = POLLIN},
+        [PollSignal] = {.fd = signal_fd, .events = POLLIN},
+        [PollTimer] = {.fd = timer_fd, .events = POLLIN},
+        [PollIpc] = {.fd = ipc_fd, .events = POLLIN},
     };
+    for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+        pfd[PollClients + i] = (struct pollfd){.fd = ipc_clients[i].fd, .events = POLLIN};
+    if (poll(pfd, LENGTH(pfd), -1) <= 0) return;
+    if (pfd[PollSignal].revents & POLLIN) handle_signals();
+    if (pfd[PollTimer].revents & POLLIN) timer_run();
+    for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+        if (pfd[PollClients + i].revents && ipc_clients[i].fd >= 0) ipc_read(&ipc_clients[i]);
+    if (pfd[PollIpc].revents & POLLIN) ipc_accept();
+}
+
+static void (*handlers[LASTEvent])(XEvent *) = {
+    [ButtonPress] = buttonpress,
+    [ConfigureRequest] = configurerequest,
+    [MapRequest] = maprequest,
+    [MapNotify] = mapnotify,
+    [UnmapNotify] = unmapnotify,
+    [DestroyNotify] = destroynotify,
+    [EnterNotify] = enternotify,
+    [KeyPress] = keypress,
+    [MappingNotify] = mappingnotify,
+    [MotionNotify] = motionnotify,
+    [PropertyNotify] = propertynotify,
+    [ButtonRelease] = buttonrelease,
+};
+
+static void dispatch(XEvent *ev) {
+    if (ev->type == rr_event_base + RRScreenChangeNotify) {
+        screenchange(ev);
+        return;
+    }
+    if (ev->type >= LASTEvent || !handlers[ev->type]) return;
+    StatMark mark = stat_begin();
+    handlers[ev->type](ev);
+    stat_end(&event_stats[ev->type], mark);
+}
+
+/* the work deferred until the queued events are drained */
+static void flush_batch(void) {
+    if (arrange_pending) arrange_now();
+    configure_flush();
+    ewmh_flush();
+    if (NextRequest(dpy) != batch_serial) {
+        /* a range whose crossings may still be queued is extended, not lost */
+        if (last_serial >= enter_to) enter_from = batch_serial;
+        enter_to = NextRequest(dpy);
+        /* so crossings from later, real pointer motion carry a newer serial */
+        XNoOp(dpy);
+        batch_serial = NextRequest(dpy);
+    }
+    XFlush(dpy);
+}
+
+static void trace_open(const char *path) {
+    size_t size = sizeof(TraceHeader) + TRACE_RECORDS * sizeof(TraceRecord);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) die("eowm: cannot create %s", path);
+    trace = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (trace == MAP_FAILED) die("eowm: cannot map %s", path);
+    memcpy(trace->magic, TRACE_MAGIC, sizeof(trace->magic));
+    trace->record_size = sizeof(TraceRecord);
+    trace->capacity = TRACE_RECORDS;
+    trace->root = root;
+    trace_records = (TraceRecord *)(trace + 1);
+}
+
+/* the slot is filled before head moves, so a crash mid-handler still leaves
+ * the event that caused it in the file */
+static TraceRecord *trace_record(const XEvent *ev) {
+    TraceRecord *r = &trace_records[trace->head % trace->capacity];
+    r->time_ns = now_ns();
+    r->handler_ns = 0;
+    r->flags = 0;
+    r->ev = *ev;
+    trace->head++;
+    return r;
+}
+
+static int replay_slot(Window w) {
+    unsigned long i = (unsigned long)w * 2654435761UL % TRACE_WINDOWS, n = 0;
+    while (replay_map[i].from && replay_map[i].from != w) {
+        if (++n == TRACE_WINDOWS) return -1;
+        i = (i + 1) % TRACE_WINDOWS;
+    }
+    return i;
+}
+
+/* recorded window ids mean nothing on the replay server: the root maps to
+ * ours, a MapRequest creates a stand-in window, anything else unknown is None */
+static Window replay_window(Window w, int create) {
+    if (w == None) return None;
+    if (w == trace->root) return root;
+    int i = replay_slot(w);
+    if (i < 0) return None;
+    if (!replay_map[i].to && create) {
+        replay_map[i].from = w;
+        replay_map[i].to = XCreateSimpleWindow(dpy, root, 0, 0, 100, 100, 0, 0, 0);
+    }
+    return replay_map[i].to;
+}
 
-    if (argc == 2 && !strcmp("-v", argv[1])) die("eowm v" VERSION);
-    if (argc != 1) die("Usage: eowm [-v]");
+/* the recorded client destroyed w, so its stand-in goes too */
+static void replay_forget(Window w) {
+    int i = w && w != trace->root ? replay_slot(w) : -1;
+    if (i < 0 || !replay_map[i].to) return;
+    XDestroyWindow(dpy, replay_map[i].to);
+    replay_map[i].to = None;
+}
+
+static void replay_remap(XEvent *ev) {
+    ev->xany.display = dpy;
+    /* recorded serials mean nothing here; a fresh one is newer than all our
+     * requests, so enternotify treats every crossing as real pointer motion */
+    ev->xany.serial = last_serial = NextRequest(dpy);
+    ev->xany.window = replay_window(ev->xany.window, 0);
+    switch (ev->type) {
+    case MapRequest:
+        ev->xmaprequest.window = replay_window(ev->xmaprequest.window, 1);
+        break;
+    case ConfigureRequest:
+        ev->xconfigurerequest.window = replay_window(ev->xconfigurerequest.window, 0);
+        ev->xconfigurerequest.above = replay_window(ev->xconfigurerequest.above, 0);
+        break;
+    case MapNotify: ev->xmap.window = replay_window(ev->xmap.window, 0); break;
+    case UnmapNotify: ev->xunmap.window = replay_window(ev->xunmap.window, 0); break;
+    case DestroyNotify: ev->xdestroywindow.window = replay_window(ev->xdestroywindow.window, 0); break;
+    case KeyPress:
+    case ButtonPress:
+    case EnterNotify:
+        /* key, button and crossing events share the window/root/subwindow prefix */
+        ev->xkey.root = root;
+        ev->xkey.subwindow = replay_window(ev->xkey.subwindow, 0);
+        break;
+    }
+}
+
+/* feed a trace through dispatch() against whatever server DISPLAY points
+ * at, batch by batch as recorded, then print per-handler latency and exit */
+static void replay(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(TraceHeader)) die("eowm: cannot read %s", path);
+    trace = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace == MAP_FAILED || memcmp(trace->magic, TRACE_MAGIC, sizeof(trace->magic)) ||
+        trace->record_size != sizeof(TraceRecord) || !trace->capacity ||
+        (uint64_t)st.st_size < sizeof(TraceHeader) + (uint64_t)trace->capacity * sizeof(TraceRecord))
+        die("eowm: %s is not a trace from this build", path);
+    trace_records = (TraceRecord *)(trace + 1);
+
+    uint64_t first = trace->head > trace->capacity ? trace->head - trace->capacity : 0;
+    unsigned long events = 0, batches = 0, recorded_us = 0, replayed_us = 0;
+    replaying = 1;
+    stats_enabled = 1;
+    for (uint64_t i = first; i < trace->head; i++) {
+        const TraceRecord *r = &trace_records[i % trace->capacity];
+        XEvent ev = r->ev;
+        replay_remap(&ev);
+        /* what the recorded client did to its own window before we heard of it */
+        if (ev.type == UnmapNotify && !ev.xunmap.send_event && ev.xunmap.window)
+            XUnmapWindow(dpy, ev.xunmap.window);
+        dispatch(&ev);
+        if (ev.type == DestroyNotify) replay_forget(r->ev.xdestroywindow.window);
+        recorded_us += r->handler_ns / 1000;
+        events++;
+        if (r->flags & TRACE_BATCH_END) {
+            flush_batch();
+            XSync(dpy, True); /* the server's own events for the stand-ins are already in the trace */
+            batches++;
+        }
+    }
+    flush_batch();
+    for (int i = 0; i < LASTEvent; i++)
+        replayed_us += event_stats[i].total_us;
+    fprintf(stderr, "eowm: replayed %lu events in %lu batches, handlers took %luus, %luus when recorded\n",
+            events, batches, replayed_us, recorded_us);
+    dump_stats();
+    quit(NULL);
+}
+
+int main(int argc, char *argv[]) {
+    XEvent ev;
+    const char *trace_path = NULL, *replay_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp("-v", argv[i])) die("eowm v" VERSION);
+        else if (!strcmp("-s", argv[i])) stats_enabled = 1;
+        else if (!strcmp("-t", argv[i]) && i + 1 < argc) trace_path = argv[++i];
+        else if (!strcmp("-r", argv[i]) && i + 1 < argc) replay_path = argv[++i];
+        else die("Usage: eowm [-v] [-s] [-t trace] [-r trace]");
+    }
     if (!getenv("DISPLAY")) die("DISPLAY environment variable not set");
     if (!(dpy = XOpenDisplay(NULL))) die("cannot open X11 display");
+    xc = XGetXCBConnection(dpy);
+    fcntl(ConnectionNumber(dpy), F_SETFD, FD_CLOEXEC);
 
     XSetErrorHandler(xerror);
-    signal(SIGCHLD, sigchld_handler);
+    setup_signals();
 
     screen = DefaultScreen(dpy);
     root = RootWindow(dpy, screen);
     sw = DisplayWidth(dpy, screen);
     sh = DisplayHeight(dpy, screen);
-    master_size = default_master_size;
 
     border_normal = getcolor(col_border_normal);
     border_focused = getcolor(col_border_focused);
     XClearWindow(dpy, root);
-    XDefineCursor(dpy, root, XCreateFontCursor(dpy, XC_left_ptr));
+    cursor_normal = XCreateFontCursor(dpy, XC_left_ptr);
+    cursor_move = XCreateFontCursor(dpy, XC_fleur);
+    cursor_resize = XCreateFontCursor(dpy, XC_sizing);
+    XDefineCursor(dpy, root, cursor_normal);
 
-    net_wm_strut = XInternAtom(dpy, "_NET_WM_STRUT", False);
-    net_wm_strut_partial = XInternAtom(dpy, "_NET_WM_STRUT_PARTIAL", False);
-    net_wm_window_type = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
+    XInternAtoms(dpy, (char **)atom_names, AtomLast, False, atoms);
+    ewmh_setup();
 
+    int rr_error_base;
+    if (!XRRQueryExtension(dpy, &rr_event_base, &rr_error_base)) rr_event_base = -1;
     update_monitors();
-    XRRSelectInput(dpy, root, RRScreenChangeNotifyMask);
+    if (rr_event_base >= 0) XRRSelectInput(dpy, root, RRScreenChangeNotifyMask);
     XSelectInput(dpy, root, SubstructureRedirectMask | SubstructureNotifyMask |
                             EnterWindowMask | LeaveWindowMask | FocusChangeMask |
                             StructureNotifyMask | PropertyChangeMask);
 
-    for (size_t i = 0; i < LENGTH(keys); i++)
-        XGrabKey(dpy, XKeysymToKeycode(dpy, keys[i].keysym), keys[i].mod, root, True, GrabModeAsync, GrabModeAsync);
+    grabkeys();
+    grabbuttons();
+    prepare_spawn();
+    ipc_setup();
 
     scan();
+    if (replay_path) replay(replay_path);
+    if (trace_path) trace_open(trace_path);
     while (1) {
-        XNextEvent(dpy, &ev);
-        if (handlers[ev.type])
-            handlers[ev.type](&ev);
+        flush_batch();
+        if (!XPending(dpy)) wait_input();
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            last_serial = ev.xany.serial;
+            TraceRecord *r = trace ? trace_record(&ev) : NULL;
+            dispatch(&ev);
+            if (r) r->handler_ns = now_ns() - r->time_ns;
+        }
+        if (trace && trace->head) trace_records[(trace->head - 1) % trace->capacity].flags |= TRACE_BATCH_END;
     }
 }
@@ -0,0 +1,58 @@
+/* layout.h - tiling geometry, free of Xlib so it can run without a server */
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+typedef struct {
+    int x, y, w, h;
+} Rect;
+
+/* Tile n windows on mon minus struts (left, right, top, bottom) and padding.
+ * geom[0] is the master on the right, geom[1..n-1] the stack on the left top
+ * to bottom. Stack windows are at least min_h tall; when that many do not
+ * fit they overlap evenly instead of running past the bottom edge. Struts or
+ * padding that leave no room are ignored, so every rect stays on mon. */
+static void layout_tile(Rect mon, const int struts[4], int padding, double master_size,
+                        int min_h, int n, Rect *geom) {
+    int x0 = mon.x + struts[0] + padding, w = mon.w - struts[0] - struts[1] - 2 * padding;
+    int y0 = mon.y + struts[2] + padding, h = mon.h - struts[2] - struts[3] - 2 * padding;
+    if (w < 1) {
+        x0 = mon.x;
+        w = mon.w > 1 ? mon.w : 1;
+    }
+    if (h < 1) {
+        y0 = mon.y;
+        h = mon.h > 1 ? mon.h : 1;
+    }
+    if (n < 1) return;
+    if (n == 1) {
+        geom[0] = (Rect){x0, y0, w, h};
+        return;
+    }
+
+    int mw = (int)(w * master_size), gap = padding;
+    if (mw < 1) mw = 1;
+    if (w - mw - gap < 1) gap = 0;
+    int sw = w - mw - gap;
+    if (sw < 1) {
+        mw = w > 1 ? w - 1 : 1;
+        sw = 1;
+    }
+    geom[0] = (Rect){x0 + w - mw, y0, mw, h};
+
+    int k = n - 1;
+    if (min_h > h) min_h = h;
+    if (min_h < 1) min_h = 1;
+    int th = (h - (k - 1) * padding) / k;
+    if (th >= min_h) {
+        for (int i = 1, y = y0; i < n; i++) {
+            int sh = i < n - 1 ? th : y0 + h - y;
+            geom[i] = (Rect){x0, y, sw, sh};
+            y += sh + padding;
+        }
+    } else {
+        for (int i = 1; i < n; i++)
+            geom[i] = (Rect){x0, y0 + (int)((long)(h - min_h) * (i - 1) / (k > 1 ? k - 1 : 1)), sw, min_h};
+    }
+}
+
+#endif